@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "band_writer.h"
+
+/* BAND WRITER DEFINITION */
+
+static bool write_band(band_writer *w, framebuffer *band) {
+    // PPM rows run top to bottom, PFM rows bottom to top
+    color c;
+    for (int k = 0; k < band->height; k++) {
+        int j = (w->format == BAND_PPM) ? k : band->height - 1 - k;
+        size_t bytes;
+        if (w->format == BAND_PPM) {
+            for (int i = 0; i < band->width; i++) {
+                framebuffer_get(band, i, j, &c);
+                color_bytes(&c, &w->row[(size_t)i * 3]);
+            }
+            bytes = (size_t)band->width * 3;
+        } else {
+            for (int i = 0; i < band->width; i++) {
+                framebuffer_get(band, i, j, &c);
+                float rgb[3] = {(float)c[0], (float)c[1], (float)c[2]};
+                memcpy(&w->row[(size_t)i * sizeof(rgb)], rgb, sizeof(rgb));
+            }
+            bytes = (size_t)band->width * 3 * sizeof(float);
+        }
+        if (fwrite(w->row, 1, bytes, w->file) != bytes) return false;
+    }
+    return true;
+}
+
+static void *writer_thread(void *arg) {
+    band_writer *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->queue_count == 0 && w->closing == false) pthread_cond_wait(&w->changed, &w->lock);
+        if (w->queue_count == 0) break;
+        int index = w->queue[w->queue_head];
+        w->queue_head = (w->queue_head + 1) % w->band_count;
+        w->queue_count--;
+
+        // Encode and write without the lock so the renderer keeps going
+        pthread_mutex_unlock(&w->lock);
+        bool written = write_band(w, &w->bands[index]);
+        pthread_mutex_lock(&w->lock);
+
+        if (written == false) w->failed = true;
+        w->idle[w->idle_count++] = index;
+        pthread_cond_broadcast(&w->changed);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+bool band_writer_open(band_writer *w, FILE *file, band_format format, int width, int height, int band_height, int queue_depth) {
+    // Write the header first, a file that cannot take it gets no buffers and no thread
+    memset(w, 0, sizeof(*w));
+    if (format == BAND_PPM) fprintf(file, "P6\n%d %d\n255\n", width, height);
+    else fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+    if (fflush(file) != 0 || ferror(file)) return false;
+
+    w->file = file;
+    w->format = format;
+    w->width = width;
+    w->height = height;
+    w->band_height = band_height;
+
+    // One band being rendered plus the ones waiting to be written
+    w->band_count = queue_depth + 1;
+    w->bands = malloc(sizeof(framebuffer) * (size_t)w->band_count);
+    w->idle = malloc(sizeof(int) * (size_t)w->band_count);
+    w->queue = malloc(sizeof(int) * (size_t)w->band_count);
+    w->row = malloc((size_t)width * 3 * sizeof(float));
+    if (w->bands == NULL || w->idle == NULL || w->queue == NULL || w->row == NULL) {
+        fprintf(stderr, "Memory allocation failed for band writer\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < w->band_count; k++) {
+        framebuffer_create(&w->bands[k], width, band_height);
+        w->idle[w->idle_count++] = k;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->changed, NULL);
+    if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+        fprintf(stderr, "Could not start band writer thread\n");
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+framebuffer *band_writer_acquire(band_writer *w, int rows) {
+    // Blocks while every band is still queued, which bounds memory
+    pthread_mutex_lock(&w->lock);
+    while (w->idle_count == 0) pthread_cond_wait(&w->changed, &w->lock);
+    framebuffer *band = &w->bands[w->idle[--w->idle_count]];
+    pthread_mutex_unlock(&w->lock);
+
+    band->height = rows;
+    memset(band->pixels, 0, sizeof(double) * 3 * (size_t)w->width * (size_t)w->band_height);
+    memset(band->samples, 0, sizeof(int) * (size_t)w->width * (size_t)w->band_height);
+    return band;
+}
+
+void band_writer_submit(band_writer *w, framebuffer *band) {
+    pthread_mutex_lock(&w->lock);
+    w->queue[(w->queue_head + w->queue_count) % w->band_count] = (int)(band - w->bands);
+    w->queue_count++;
+    pthread_cond_broadcast(&w->changed);
+    pthread_mutex_unlock(&w->lock);
+}
+
+bool band_writer_close(band_writer *w) {
+    // Drain the queue, then release every band
+    pthread_mutex_lock(&w->lock);
+    w->closing = true;
+    pthread_cond_broadcast(&w->changed);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    bool written = w->failed == false && fflush(w->file) == 0;
+    for (int k = 0; k < w->band_count; k++) framebuffer_free(&w->bands[k]);
+    free(w->bands);
+    free(w->idle);
+    free(w->queue);
+    free(w->row);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->changed);
+    return written;
+}
+
+size_t band_writer_size(band_writer *w) {
+    // Bytes held by band buffers, independent of the image height
+    size_t pixels = (size_t)w->width * (size_t)w->band_height;
+    return ((size_t)w->band_count * pixels * ((3 * sizeof(double)) + sizeof(int))) + ((size_t)w->width * 3 * sizeof(float));
+}
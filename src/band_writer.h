@@ -0,0 +1,45 @@
+#ifndef BAND_WRITER_H
+#define BAND_WRITER_H
+
+#include <pthread.h>
+
+#include "framebuffer.h"
+
+/* BAND WRITER DEFINITION */
+
+typedef enum {
+    BAND_PPM, // Binary 8-bit PPM, bands go top to bottom
+    BAND_PFM // Float PFM, bands go bottom to top like its rows
+} band_format;
+
+// Finished bands are encoded and appended by a background thread
+typedef struct {
+    FILE *file;
+    band_format format;
+    int width;
+    int height;
+    int band_height;
+    pthread_t thread;
+    unsigned char *row; // Encoded row, only touched by the writer thread
+
+    // Every band buffer there will ever be, either idle or queued for writing
+    framebuffer *bands;
+    int band_count;
+    int *idle;
+    int idle_count;
+    int *queue; // Ring of band indices in file order
+    int queue_head;
+    int queue_count;
+    bool closing;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} band_writer;
+
+bool band_writer_open(band_writer *w, FILE *file, band_format format, int width, int height, int band_height, int queue_depth);
+framebuffer *band_writer_acquire(band_writer *w, int rows);
+void band_writer_submit(band_writer *w, framebuffer *band);
+bool band_writer_close(band_writer *w);
+size_t band_writer_size(band_writer *w);
+
+#endif
@@ -0,0 +1,559 @@
+#include <string.h>
+
+#include "bvh.h"
+#include "thread_pool.h"
+
+/* BVH DEFINITION */
+
+typedef struct {
+    hittable_list *list;
+    aabb *bounds; // Bounds of each primitive, kept in the same order as ids
+    point3 *centroids;
+    uint32_t *ids;
+    bvh_node *nodes; // Depth-first node array this builder writes to
+    int node_count;
+} bvh_builder;
+
+typedef struct {
+    aabb bounds;
+    int count;
+} bvh_bin;
+
+static double surface_area(aabb *box) {
+    double dx = box->max[0] - box->min[0];
+    double dy = box->max[1] - box->min[1];
+    double dz = box->max[2] - box->min[2];
+    return 2.0 * ((dx * dy) + (dy * dz) + (dz * dx));
+}
+
+static void empty_box(aabb *box) {
+    create(&box->min, INFINITY, INFINITY, INFINITY);
+    create(&box->max, -INFINITY, -INFINITY, -INFINITY);
+}
+
+static void grow_point(aabb *box, point3 *p) {
+    for (int axis = 0; axis < 3; axis++) {
+        if ((*p)[axis] < box->min[axis]) box->min[axis] = (*p)[axis];
+        if ((*p)[axis] > box->max[axis]) box->max[axis] = (*p)[axis];
+    }
+}
+
+static void swap_primitives(bvh_builder *b, int x, int y) {
+    aabb box = b->bounds[x];
+    b->bounds[x] = b->bounds[y];
+    b->bounds[y] = box;
+
+    point3 c;
+    create(&c, b->centroids[x][0], b->centroids[x][1], b->centroids[x][2]);
+    create(&b->centroids[x], b->centroids[y][0], b->centroids[y][1], b->centroids[y][2]);
+    create(&b->centroids[y], c[0], c[1], c[2]);
+
+    uint32_t id = b->ids[x];
+    b->ids[x] = b->ids[y];
+    b->ids[y] = id;
+}
+
+static int bin_of(double centroid, double min, double width) {
+    int bin = (int)(BVH_BINS * ((centroid - min) / width));
+    return (bin >= BVH_BINS) ? BVH_BINS - 1 : bin;
+}
+
+static void empty_bins(bvh_bin bins[3][BVH_BINS]) {
+    for (int a = 0; a < 3; a++) {
+        for (int k = 0; k < BVH_BINS; k++) {
+            empty_box(&bins[a][k].bounds);
+            bins[a][k].count = 0;
+        }
+    }
+}
+
+static void fill_bins(bvh_builder *b, int begin, int end, aabb *centroid_bounds, bvh_bin bins[3][BVH_BINS]) {
+    for (int a = 0; a < 3; a++) {
+        double min = centroid_bounds->min[a];
+        double width = centroid_bounds->max[a] - min;
+        if (width <= 0.0) continue;
+        for (int k = begin; k < end; k++) {
+            int bin = bin_of(b->centroids[k][a], min, width);
+            bins[a][bin].count++;
+            aabb_merge(&bins[a][bin].bounds, &b->bounds[k], &bins[a][bin].bounds);
+        }
+    }
+}
+
+static double best_split(aabb *centroid_bounds, bvh_bin bins[3][BVH_BINS], int *best_axis, int *best_bin) {
+    // Sweep the bins of every axis and return the cheapest SAH split
+    double best_cost = INFINITY;
+    for (int a = 0; a < 3; a++) {
+        if (centroid_bounds->max[a] - centroid_bounds->min[a] <= 0.0) continue;
+
+        // Sweep from the right to get the area and count of every right side
+        double right_area[BVH_BINS];
+        int right_count[BVH_BINS];
+        aabb right;
+        empty_box(&right);
+        int n = 0;
+        for (int k = BVH_BINS - 1; k > 0; k--) {
+            aabb_merge(&right, &bins[a][k].bounds, &right);
+            n += bins[a][k].count;
+            right_area[k] = surface_area(&right);
+            right_count[k] = n;
+        }
+
+        // Sweep from the left and evaluate every split plane
+        aabb left;
+        empty_box(&left);
+        n = 0;
+        for (int k = 0; k < BVH_BINS - 1; k++) {
+            aabb_merge(&left, &bins[a][k].bounds, &left);
+            n += bins[a][k].count;
+            if (n == 0 || right_count[k + 1] == 0) continue;
+            double cost = (n * surface_area(&left)) + (right_count[k + 1] * right_area[k + 1]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                *best_axis = a;
+                *best_bin = k + 1;
+            }
+        }
+    }
+    return best_cost;
+}
+
+static int widest_axis(aabb *box) {
+    int axis = 0;
+    for (int a = 1; a < 3; a++) {
+        if (box->max[a] - box->min[a] > box->max[axis] - box->min[axis]) axis = a;
+    }
+    return axis;
+}
+
+static void build_node(bvh_builder *b, int index, int begin, int end, int depth) {
+    bvh_node *node = &b->nodes[index];
+    int count = end - begin;
+
+    // Bound the primitives and their centroids
+    aabb centroid_bounds;
+    empty_box(&node->bounds);
+    empty_box(&centroid_bounds);
+    for (int k = begin; k < end; k++) {
+        aabb_merge(&node->bounds, &b->bounds[k], &node->bounds);
+        grow_point(&centroid_bounds, &b->centroids[k]);
+    }
+
+    // Small or degenerate ranges become leaves
+    int axis = widest_axis(&centroid_bounds);
+    double extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+    if (count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH || extent <= 0.0) {
+        node->offset = begin;
+        node->count = count;
+        return;
+    }
+
+    // Bin centroids along every axis and keep the cheapest SAH split
+    bvh_bin bins[3][BVH_BINS];
+    empty_bins(bins);
+    fill_bins(b, begin, end, &centroid_bounds, bins);
+    int best_axis = axis, best_bin = BVH_BINS / 2;
+    double best_cost = best_split(&centroid_bounds, bins, &best_axis, &best_bin);
+
+    // Splitting must beat testing every primitive of a small enough leaf
+    double leaf_cost = count * surface_area(&node->bounds);
+    if (best_cost >= leaf_cost && count <= 4 * BVH_LEAF_SIZE) {
+        node->offset = begin;
+        node->count = count;
+        return;
+    }
+
+    // Partition primitives around the chosen bin boundary
+    int mid = begin;
+    if (best_cost < INFINITY) {
+        double min = centroid_bounds.min[best_axis];
+        double width = centroid_bounds.max[best_axis] - min;
+        for (int k = begin; k < end; k++) {
+            if (bin_of(b->centroids[k][best_axis], min, width) < best_bin) swap_primitives(b, k, mid++);
+        }
+    }
+
+    // Fall back to an even split when binning could not separate the range
+    if (mid == begin || mid == end) mid = begin + (count / 2);
+
+    // Left child follows its parent, right child follows the left subtree
+    int left_index = b->node_count++;
+    build_node(b, left_index, begin, mid, depth + 1);
+    int right_index = b->node_count++;
+    build_node(b, right_index, mid, end, depth + 1);
+    node = &b->nodes[index];
+    node->offset = right_index;
+    node->count = 0;
+}
+
+typedef struct {
+    bvh_node *nodes; // Subtree in its own depth-first array, root first
+    int node_count;
+    int begin;
+    int end;
+    int depth;
+} bvh_task;
+
+typedef struct {
+    bvh_builder *b;
+    thread_pool *pool;
+    int jobs;
+
+    // Range of the current sweep and the per-job results it merges
+    int begin;
+    int end;
+    aabb *chunk_bounds;
+    aabb *chunk_centroids;
+    bvh_bin (*chunk_bins)[3][BVH_BINS];
+    int *chunk_left; // Left count of each job, then where its left side goes
+    int *chunk_right;
+    aabb centroid_bounds;
+    int split_axis;
+    int split_bin;
+
+    // Stable partitions go through these and are copied back
+    aabb *scratch_bounds;
+    point3 *scratch_centroids;
+    uint32_t *scratch_ids;
+
+    // Upper levels built by every thread, each range below BVH_TASK_SIZE becomes a task
+    bvh_node *top;
+    int top_count;
+    int top_capacity;
+    bvh_task *tasks;
+    int task_count;
+    int task_capacity;
+} parallel_builder;
+
+static void *builder_grow(void *array, int count, int *capacity, size_t size) {
+    if (count < *capacity) return array;
+    *capacity = (*capacity == 0) ? 64 : *capacity * 2;
+    array = realloc(array, size * (size_t)*capacity);
+    if (array == NULL) {
+        fprintf(stderr, "Memory allocation failed for bvh\n");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+static void chunk_range(parallel_builder *p, int index, int *begin, int *end) {
+    *begin = p->begin + (index * BVH_CHUNK);
+    *end = (*begin + BVH_CHUNK < p->end) ? *begin + BVH_CHUNK : p->end;
+}
+
+static void gather_job(void *context, int index) {
+    parallel_builder *p = context;
+    bvh_builder *b = p->b;
+    int begin, end;
+    chunk_range(p, index, &begin, &end);
+    for (int k = begin; k < end; k++) {
+        b->ids[k] = primitive_id(b->list, k);
+        primitive_bounds(b->list, b->ids[k], &b->bounds[k]);
+        for (int axis = 0; axis < 3; axis++) b->centroids[k][axis] = 0.5 * (b->bounds[k].min[axis] + b->bounds[k].max[axis]);
+    }
+}
+
+static void bounds_job(void *context, int index) {
+    parallel_builder *p = context;
+    int begin, end;
+    chunk_range(p, index, &begin, &end);
+    empty_box(&p->chunk_bounds[index]);
+    empty_box(&p->chunk_centroids[index]);
+    for (int k = begin; k < end; k++) {
+        aabb_merge(&p->chunk_bounds[index], &p->b->bounds[k], &p->chunk_bounds[index]);
+        grow_point(&p->chunk_centroids[index], &p->b->centroids[k]);
+    }
+}
+
+static void bins_job(void *context, int index) {
+    parallel_builder *p = context;
+    int begin, end;
+    chunk_range(p, index, &begin, &end);
+    empty_bins(p->chunk_bins[index]);
+    fill_bins(p->b, begin, end, &p->centroid_bounds, p->chunk_bins[index]);
+}
+
+static bool goes_left(parallel_builder *p, int k) {
+    double min = p->centroid_bounds.min[p->split_axis];
+    double width = p->centroid_bounds.max[p->split_axis] - min;
+    return bin_of(p->b->centroids[k][p->split_axis], min, width) < p->split_bin;
+}
+
+static void count_job(void *context, int index) {
+    parallel_builder *p = context;
+    int begin, end;
+    chunk_range(p, index, &begin, &end);
+    int left = 0;
+    for (int k = begin; k < end; k++) left += goes_left(p, k);
+    p->chunk_left[index] = left;
+}
+
+static void scatter_job(void *context, int index) {
+    parallel_builder *p = context;
+    bvh_builder *b = p->b;
+    int begin, end;
+    chunk_range(p, index, &begin, &end);
+    int left = p->chunk_left[index], right = p->chunk_right[index];
+    for (int k = begin; k < end; k++) {
+        int to = goes_left(p, k) ? left++ : right++;
+        p->scratch_bounds[to] = b->bounds[k];
+        create(&p->scratch_centroids[to], b->centroids[k][0], b->centroids[k][1], b->centroids[k][2]);
+        p->scratch_ids[to] = b->ids[k];
+    }
+}
+
+static void copy_job(void *context, int index) {
+    parallel_builder *p = context;
+    bvh_builder *b = p->b;
+    int begin, end;
+    chunk_range(p, index, &begin, &end);
+    memcpy(&b->bounds[begin], &p->scratch_bounds[begin], sizeof(aabb) * (size_t)(end - begin));
+    memcpy(&b->centroids[begin], &p->scratch_centroids[begin], sizeof(point3) * (size_t)(end - begin));
+    memcpy(&b->ids[begin], &p->scratch_ids[begin], sizeof(uint32_t) * (size_t)(end - begin));
+}
+
+static void task_job(void *context, int index) {
+    // Serial build of one subtree, trimmed to the nodes it used
+    parallel_builder *p = context;
+    bvh_task *task = &p->tasks[index];
+    bvh_builder local = *p->b;
+    local.nodes = malloc(sizeof(bvh_node) * (size_t)(2 * (task->end - task->begin)));
+    if (local.nodes == NULL) {
+        fprintf(stderr, "Memory allocation failed for bvh\n");
+        exit(EXIT_FAILURE);
+    }
+    local.node_count = 1;
+    build_node(&local, 0, task->begin, task->end, task->depth);
+    task->nodes = realloc(local.nodes, sizeof(bvh_node) * (size_t)local.node_count);
+    if (task->nodes == NULL) task->nodes = local.nodes;
+    task->node_count = local.node_count;
+}
+
+static void sweep(parallel_builder *p, int begin, int end, thread_job job) {
+    p->begin = begin;
+    p->end = end;
+    thread_pool_run(p->pool, (end - begin + BVH_CHUNK - 1) / BVH_CHUNK, job, p);
+}
+
+static int build_top(parallel_builder *p, int begin, int end, int depth) {
+    // Same decisions as build_node, with every pass over the range split into jobs
+    p->top = builder_grow(p->top, p->top_count, &p->top_capacity, sizeof(bvh_node));
+    int index = p->top_count++;
+    int count = end - begin;
+    if (count < BVH_TASK_SIZE) {
+        p->tasks = builder_grow(p->tasks, p->task_count, &p->task_capacity, sizeof(bvh_task));
+        bvh_task task = {NULL, 0, begin, end, depth};
+        p->tasks[p->task_count] = task;
+        p->top[index].count = -(++p->task_count);
+        return index;
+    }
+
+    // Bound the primitives and their centroids
+    int jobs = (count + BVH_CHUNK - 1) / BVH_CHUNK;
+    bvh_node node;
+    empty_box(&node.bounds);
+    empty_box(&p->centroid_bounds);
+    sweep(p, begin, end, bounds_job);
+    for (int k = 0; k < jobs; k++) {
+        aabb_merge(&node.bounds, &p->chunk_bounds[k], &node.bounds);
+        aabb_merge(&p->centroid_bounds, &p->chunk_centroids[k], &p->centroid_bounds);
+    }
+
+    // Degenerate ranges become leaves
+    aabb centroid_bounds = p->centroid_bounds;
+    int axis = widest_axis(&centroid_bounds);
+    if (depth >= BVH_MAX_DEPTH || centroid_bounds.max[axis] - centroid_bounds.min[axis] <= 0.0) {
+        node.offset = begin;
+        node.count = count;
+        p->top[index] = node;
+        return index;
+    }
+
+    // Bin in parallel and merge the bins of every job
+    bvh_bin bins[3][BVH_BINS];
+    empty_bins(bins);
+    sweep(p, begin, end, bins_job);
+    for (int k = 0; k < jobs; k++) {
+        for (int a = 0; a < 3; a++) {
+            for (int n = 0; n < BVH_BINS; n++) {
+                bins[a][n].count += p->chunk_bins[k][a][n].count;
+                aabb_merge(&bins[a][n].bounds, &p->chunk_bins[k][a][n].bounds, &bins[a][n].bounds);
+            }
+        }
+    }
+    int best_axis = axis, best_bin = BVH_BINS / 2;
+    double best_cost = best_split(&centroid_bounds, bins, &best_axis, &best_bin);
+
+    // Stable partition, each job writes its left and right sides at offsets from a prefix sum
+    int mid = begin;
+    if (best_cost < INFINITY) {
+        p->split_axis = best_axis;
+        p->split_bin = best_bin;
+        sweep(p, begin, end, count_job);
+        int left = begin, right = begin;
+        for (int k = 0; k < jobs; k++) right += p->chunk_left[k];
+        mid = right;
+        for (int k = 0; k < jobs; k++) {
+            int chunk_begin, chunk_end;
+            chunk_range(p, k, &chunk_begin, &chunk_end);
+            int left_count = p->chunk_left[k];
+            p->chunk_left[k] = left;
+            p->chunk_right[k] = right;
+            left += left_count;
+            right += (chunk_end - chunk_begin) - left_count;
+        }
+        sweep(p, begin, end, scatter_job);
+        sweep(p, begin, end, copy_job);
+    }
+
+    // Fall back to an even split when binning could not separate the range
+    if (mid == begin || mid == end) mid = begin + (count / 2);
+
+    build_top(p, begin, mid, depth + 1);
+    int right_index = build_top(p, mid, end, depth + 1);
+    node.offset = right_index;
+    node.count = 0;
+    p->top[index] = node;
+    return index;
+}
+
+static int emit_node(parallel_builder *p, int index, bvh_node *out, int *out_count) {
+    // Rebuild the depth-first order, splicing each task's subtree in where it was cut off
+    bvh_node node = p->top[index];
+    int at = *out_count;
+    if (node.count < 0) {
+        bvh_task *task = &p->tasks[-node.count - 1];
+        for (int k = 0; k < task->node_count; k++) {
+            out[at + k] = task->nodes[k];
+            if (out[at + k].count == 0) out[at + k].offset += at;
+        }
+        *out_count += task->node_count;
+        free(task->nodes);
+        task->nodes = NULL;
+        return at;
+    }
+    (*out_count)++;
+    if (node.count == 0) {
+        emit_node(p, index + 1, out, out_count);
+        node.offset = emit_node(p, node.offset, out, out_count);
+    }
+    out[at] = node;
+    return at;
+}
+
+static void build_parallel(bvh_builder *b, int count, thread_pool *pool) {
+    parallel_builder p;
+    memset(&p, 0, sizeof(p));
+    p.b = b;
+    p.pool = pool;
+    p.jobs = (count + BVH_CHUNK - 1) / BVH_CHUNK;
+    p.chunk_bounds = malloc(sizeof(aabb) * (size_t)p.jobs);
+    p.chunk_centroids = malloc(sizeof(aabb) * (size_t)p.jobs);
+    p.chunk_bins = malloc(sizeof(*p.chunk_bins) * (size_t)p.jobs);
+    p.chunk_left = malloc(sizeof(int) * (size_t)p.jobs);
+    p.chunk_right = malloc(sizeof(int) * (size_t)p.jobs);
+    p.scratch_bounds = malloc(sizeof(aabb) * (size_t)count);
+    p.scratch_centroids = malloc(sizeof(point3) * (size_t)count);
+    p.scratch_ids = malloc(sizeof(uint32_t) * (size_t)count);
+    if (p.chunk_bounds == NULL || p.chunk_centroids == NULL || p.chunk_bins == NULL || p.chunk_left == NULL || p.chunk_right == NULL || p.scratch_bounds == NULL || p.scratch_centroids == NULL || p.scratch_ids == NULL) {
+        fprintf(stderr, "Memory allocation failed for bvh\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Upper levels with every thread, then whole subtrees handed out one per job
+    build_top(&p, 0, count, 0);
+    free(p.scratch_bounds);
+    free(p.scratch_centroids);
+    free(p.scratch_ids);
+    thread_pool_run(pool, p.task_count, task_job, &p);
+
+    // Splice everything into one array of exactly the nodes used
+    int total = p.top_count - p.task_count;
+    for (int k = 0; k < p.task_count; k++) total += p.tasks[k].node_count;
+    b->nodes = malloc(sizeof(bvh_node) * (size_t)total);
+    if (b->nodes == NULL) {
+        fprintf(stderr, "Memory allocation failed for bvh\n");
+        exit(EXIT_FAILURE);
+    }
+    b->node_count = 0;
+    emit_node(&p, 0, b->nodes, &b->node_count);
+
+    free(p.chunk_bounds);
+    free(p.chunk_centroids);
+    free(p.chunk_bins);
+    free(p.chunk_left);
+    free(p.chunk_right);
+    free(p.top);
+    free(p.tasks);
+}
+
+void bvh_build(hittable_list *list) {
+    bvh_build_threads(list, cpu_count());
+}
+
+void bvh_build_threads(hittable_list *list, int threads) {
+    if (list->mapping != NULL) {
+        fprintf(stderr, "Cannot rebuild the bvh of a compiled scene\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int count = primitive_count(list);
+    free(list->nodes);
+    free(list->prims);
+    list->nodes = NULL;
+    list->prims = NULL;
+    list->node_count = 0;
+    if (count == 0) return;
+
+    // Gather bounds and centroids of every bounded primitive
+    bvh_builder b;
+    b.list = list;
+    b.bounds = malloc(sizeof(aabb) * (size_t)count);
+    b.centroids = malloc(sizeof(point3) * (size_t)count);
+    b.ids = malloc(sizeof(uint32_t) * (size_t)count);
+    if (b.bounds == NULL || b.centroids == NULL || b.ids == NULL) {
+        fprintf(stderr, "Memory allocation failed for bvh\n");
+        exit(EXIT_FAILURE);
+    }
+    thread_pool pool;
+    thread_pool_create(&pool, (count < BVH_TASK_SIZE) ? 1 : threads);
+    parallel_builder gather;
+    memset(&gather, 0, sizeof(gather));
+    gather.b = &b;
+    gather.pool = &pool;
+    sweep(&gather, 0, count, gather_job);
+
+    if (pool.worker_count == 0) {
+        // Build depth first from the root
+        b.nodes = malloc(sizeof(bvh_node) * (size_t)(2 * count));
+        if (b.nodes == NULL) {
+            fprintf(stderr, "Memory allocation failed for bvh\n");
+            exit(EXIT_FAILURE);
+        }
+        b.node_count = 1;
+        build_node(&b, 0, 0, count, 0);
+    } else {
+        build_parallel(&b, count, &pool);
+    }
+    thread_pool_free(&pool);
+
+    // Leaves index the reordered primitive ids
+    list->nodes = b.nodes;
+    list->prims = b.ids;
+    list->node_count = b.node_count;
+    free(b.bounds);
+    free(b.centroids);
+}
+
+double bvh_cost(hittable_list *list) {
+    // SAH cost relative to the root: expected node visits plus primitive tests
+    if (list->node_count == 0) return 0.0;
+    double root_area = surface_area(&list->nodes[0].bounds);
+    double cost = 0.0;
+    for (int k = 0; k < list->node_count; k++) {
+        bvh_node *node = &list->nodes[k];
+        double weight = surface_area(&node->bounds) / root_area;
+        cost += (node->count > 0) ? weight * node->count : weight;
+    }
+    return cost;
+}
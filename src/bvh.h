@@ -0,0 +1,18 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "object.h"
+
+/* BVH DEFINITION */
+
+#define BVH_BINS      16
+#define BVH_LEAF_SIZE 4
+#define BVH_MAX_DEPTH 60 // Well inside BVH_STACK_SIZE
+#define BVH_TASK_SIZE 65536 // Ranges below this are built by one thread as one task
+#define BVH_CHUNK     16384 // Primitives per job when a range is split over threads
+
+void bvh_build(hittable_list *list);
+void bvh_build_threads(hittable_list *list, int threads);
+double bvh_cost(hittable_list *list);
+
+#endif
@@ -1,9 +1,21 @@
+#define _POSIX_C_SOURCE 199309L
+
 #include <time.h>
 
 #include "camera.h"
+#include "environment.h"
+#include "gbuffer.h"
+#include "guide.h"
+#include "profile.h"
 
 /* CAMERA DEFINITION */
 
+double wall_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec * 1e-9);
+}
+
 void camera_create(camera *cam, point3 *lookfrom, point3 *lookat, vec3 *vup, double defocus_angle, double focus_dist, int samples_per_pixel, int max_depth, double vfov, double aspect_ratio, int image_width) {
     // Initialize camera parameters
     cam->aspect_ratio = aspect_ratio;
@@ -16,6 +28,13 @@ void camera_create(camera *cam, point3 *lookfrom, point3 *lookat, vec3 *vup, dou
     cam->samples_per_pixel = samples_per_pixel;
     cam->pixel_samples_scale = 1.0 / (double)samples_per_pixel;
     cam->max_depth = max_depth;
+    cam->seed = 0;
+    cam->gbuffer = NULL;
+    cam->profile = NULL;
+    cam->row_order = NULL;
+    cam->preview = NULL;
+    cam->preview_user = NULL;
+    cam->preview_depth = 4;
 
     // Calculate viewport dimensions
     double theta = DEG_TO_RAD(vfov); 
@@ -41,6 +60,9 @@ void camera_create(camera *cam, point3 *lookfrom, point3 *lookat, vec3 *vup, dou
     divide(&cam->viewport_u, (double)image_width, &cam->delta_u);
     divide(&cam->viewport_v, (double)cam->image_height, &cam->delta_v);
 
+    // Angle covered by one pixel, the spread of every primary ray cone
+    cam->pixel_spread = length(&cam->delta_u) / focus_dist;
+
     // Calculate location of upper left pixel
     vec3 viewport_upper_left;
     viewport_upper_left[0] = cam->center[0] - (focus_dist * cam->w[0]) - (cam->viewport_u[0] / 2) - (cam->viewport_v[0] / 2);
@@ -64,9 +86,8 @@ void camera_render(camera *cam, hittable_list *list, FILE *image) {
     // Write PPM header
     fprintf(image, "P3\n%d %d\n255\n", cam->image_width, cam->image_height);
 
-    // Create variables for pixel color and ray
+    // Create variables for pixel color
     color pixel_color, sample;
-    ray r;
 
     // Timing variables
     clock_t start_time = clock();
@@ -90,8 +111,7 @@ void camera_render(camera *cam, hittable_list *list, FILE *image) {
 
             // Accumulate color for each sample
             for (int s = 0; s < cam->samples_per_pixel; s++) {
-                get_ray(cam, i, j, &r);
-                ray_color(&r, cam->max_depth, list, &sample);
+                camera_sample(cam, list, i, j, s, &sample, NULL);
                 add(&pixel_color, &sample, &pixel_color);
             }
 
@@ -101,9 +121,260 @@ void camera_render(camera *cam, hittable_list *list, FILE *image) {
         }
     }
 
+    // Every cached sample has now been written for this camera and geometry
+    if (cam->gbuffer != NULL) cam->gbuffer->valid = true;
+
+    printf("\nImage finished rendering\n");
+}
+
+void camera_render_bands(camera *cam, hittable_list *list, band_writer *writer) {
+    // Only the writer's bands are resident, each is finished before it is handed over
+    int band_count = (cam->image_height + writer->band_height - 1) / writer->band_height;
+    double start_time = wall_time();
+    color sample;
+
+    for (int k = 0; k < band_count; k++) {
+        // Bands are rendered in the order the file stores them
+        int b = (writer->format == BAND_PFM) ? band_count - 1 - k : k;
+        int first = b * writer->band_height;
+        int rows = (first + writer->band_height <= cam->image_height) ? writer->band_height : cam->image_height - first;
+
+        double elapsed = wall_time() - start_time;
+        printf("\rRendering band %d/%d | Elapsed: %.1fs", k + 1, band_count, elapsed);
+        fflush(stdout);
+
+        framebuffer *band = band_writer_acquire(writer, rows);
+        for (int j = 0; j < rows; j++) {
+            for (int i = 0; i < cam->image_width; i++) {
+                for (int s = 0; s < cam->samples_per_pixel; s++) {
+                    camera_sample(cam, list, i, first + j, s, &sample, NULL);
+                    framebuffer_add(band, i, j, &sample);
+                }
+            }
+        }
+        band_writer_submit(writer, band);
+    }
+
+    if (cam->gbuffer != NULL) cam->gbuffer->valid = true;
     printf("\nImage finished rendering\n");
 }
 
+static void trace_sample(camera *cam, hittable_list *list, int i, int j, int s, color *out, path_stats *stats) {
+    ray r;
+    hit_record rec;
+    gbuffer *gb = cam->gbuffer;
+    bool cached = (gb != NULL) && (s < gb->samples);
+
+    // Shade straight from the cached primary hit when it is still valid
+    if (cached && gb->valid) {
+        stats->segments++;
+        if (gbuffer_fetch(gb, cam, list, i, j, s, &r, &rec, &stats->primary_id)) ray_color_hit(&r, &rec, cam->max_depth, list, out, stats);
+        else background(list, &r, out);
+        return;
+    }
+
+    // Every sample gets its own random stream so it can be replayed
+    uint64_t pixel = ((uint64_t)j * (uint64_t)cam->image_width) + (uint64_t)i;
+    random_seed(cam->seed ^ (pixel * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)s * 0xC2B2AE3D27D4EB4FULL));
+    get_ray(cam, i, j, &r);
+    if (cached == false) {
+        ray_color(&r, cam->max_depth, list, out, stats);
+        return;
+    }
+
+    // Trace the primary ray and record it before shading
+    hit_query query;
+    interval ray_t = {0.001, INFINITY};
+    stats->segments++;
+    if (closest_hit(list, &r, &ray_t, &query, &stats->tests)) {
+        stats->primary_id = query.id;
+        hit_attributes(list, &r, &query, &rec);
+        gbuffer_store(gb, cam, i, j, s, &r, query.id, &rec);
+        ray_color_hit(&r, &rec, cam->max_depth, list, out, stats);
+    } else {
+        gbuffer_store(gb, cam, i, j, s, &r, GBUFFER_MISS, NULL);
+        background(list, &r, out);
+    }
+}
+
+void camera_sample(camera *cam, hittable_list *list, int i, int j, int s, color *out, path_stats *stats) {
+    // Statistics go to the caller, or only to the profile when the caller passes NULL
+    path_stats local;
+    if (stats == NULL) stats = &local;
+    stats->segments = 0;
+    stats->primary_id = PROFILE_MISS;
+    stats->truncated = false;
+    stats->tests = 0;
+    if (cam->profile == NULL) {
+        trace_sample(cam, list, i, j, s, out, stats);
+        return;
+    }
+
+    // Time the sample and count the work it caused
+    double start = wall_time();
+    trace_sample(cam, list, i, j, s, out, stats);
+    double nanoseconds = (wall_time() - start) * 1e9;
+    render_profile_add(cam->profile, i, j, stats->primary_id, nanoseconds, (double)stats->tests, stats->segments);
+}
+
+static int *interleaved_rows(int height) {
+    // Bit-reversed row order so any prefix of a pass is spread over the image
+    int *order = malloc(sizeof(int) * (size_t)height);
+    if (order == NULL) {
+        fprintf(stderr, "Memory allocation failed for row order\n");
+        exit(EXIT_FAILURE);
+    }
+    int bits = 0;
+    while ((1 << bits) < height) bits++;
+    int count = 0;
+    for (int k = 0; k < (1 << bits); k++) {
+        int row = 0;
+        for (int b = 0; b < bits; b++) {
+            if (k & (1 << b)) row |= 1 << (bits - 1 - b);
+        }
+        if (row < height) order[count++] = row;
+    }
+    return order;
+}
+
+static void render_preview(camera *cam, hittable_list *list, framebuffer *fb) {
+    // 1 spp at 1/16, 1/8, 1/4 and 1/2 resolution, every level adds to the ones before
+    framebuffer shown;
+    framebuffer_create(&shown, cam->image_width, cam->image_height);
+    int max_depth = cam->max_depth;
+    bool capped = cam->preview_depth < max_depth;
+    if (capped) cam->max_depth = cam->preview_depth;
+
+    // Capped and sparse paths would skew what the guide learns, it has nothing to offer yet anyway
+    guide *paths = list->guide;
+    list->guide = NULL;
+    color sample;
+    path_stats stats;
+
+    for (int scale = 16; scale >= 2; scale /= 2) {
+        for (int j = 0; j < cam->image_height; j += scale) {
+            for (int i = 0; i < cam->image_width; i += scale) {
+                size_t index = ((size_t)j * (size_t)cam->image_width) + (size_t)i;
+                if (shown.samples[index] > 0) continue;
+
+                // Paths that ended before the cap match the full render, so the image keeps them
+                camera_sample(cam, list, i, j, fb->samples[index], &sample, &stats);
+                framebuffer_add(&shown, i, j, &sample);
+                if (capped == false || stats.truncated == false) framebuffer_add(fb, i, j, &sample);
+            }
+        }
+
+        // Hand over the level at its own resolution, one pixel per block
+        framebuffer level;
+        framebuffer_create(&level, (cam->image_width + scale - 1) / scale, (cam->image_height + scale - 1) / scale);
+        for (int j = 0; j < level.height; j++) {
+            for (int i = 0; i < level.width; i++) {
+                framebuffer_get(&shown, i * scale, j * scale, &sample);
+                framebuffer_add(&level, i, j, &sample);
+            }
+        }
+        cam->preview(&level, scale, cam->preview_user);
+        framebuffer_free(&level);
+    }
+
+    cam->max_depth = max_depth;
+    list->guide = paths;
+    framebuffer_free(&shown);
+}
+
+void camera_render_budget(camera *cam, hittable_list *list, framebuffer *fb, double budget, render_stats *stats) {
+    int *order = (cam->row_order != NULL) ? cam->row_order : interleaved_rows(cam->image_height);
+    double start_time = wall_time();
+    double deadline = start_time + budget;
+    double pass_start = start_time; // Throughput is measured from here
+    double pixels = (double)cam->image_width * (double)cam->image_height;
+    double throughput = 0.0; // Measured samples per second
+    int pass_samples = 1;
+    int done_samples = 0; // Samples every pixel has received from complete passes
+    bool out_of_time = false;
+    color sample;
+
+    stats->budget = budget;
+    stats->start = start_time;
+    stats->passes = 0;
+    stats->samples = 0;
+
+    // Coarse images first, their capped paths would skew the throughput
+    if (cam->preview != NULL) {
+        render_preview(cam, list, fb);
+        pass_start = wall_time();
+    }
+
+    // Progressive passes until the budget or the sample count runs out
+    while (done_samples < cam->samples_per_pixel) {
+        for (int k = 0; k < cam->image_height; k++) {
+            // Only start a row that is expected to finish before the deadline
+            double now = wall_time();
+            if (stats->samples > 0) throughput = (double)stats->samples / (now - pass_start);
+            double row_cost = (throughput > 0.0) ? (double)pass_samples * (double)cam->image_width / throughput : 0.0;
+            if (now + row_cost > deadline) {
+                out_of_time = true;
+                break;
+            }
+
+            // Top up every pixel, those the preview already sampled need fewer
+            int j = order[k];
+            int target = done_samples + pass_samples;
+            for (int i = 0; i < cam->image_width; i++) {
+                while (fb->samples[(j * fb->width) + i] < target) {
+                    camera_sample(cam, list, i, j, fb->samples[(j * fb->width) + i], &sample, NULL);
+                    framebuffer_add(fb, i, j, &sample);
+                    stats->samples++;
+                }
+            }
+        }
+
+        // Past the deadline nothing uses a rebuilt guide or another preview, the caller writes the image
+        if (out_of_time) break;
+        done_samples += pass_samples;
+        stats->passes++;
+
+        // Rebuild the sampling distributions from everything recorded so far, if another pass follows
+        if (list->guide != NULL && done_samples < cam->samples_per_pixel) guide_update(list->guide);
+        if (cam->preview != NULL) cam->preview(fb, 1, cam->preview_user);
+
+        // Calibrate the next pass to use about half of the remaining time
+        double now = wall_time();
+        throughput = (double)stats->samples / (now - pass_start);
+        double affordable = 0.5 * (deadline - now) * throughput / pixels;
+        int remaining = cam->samples_per_pixel - done_samples;
+
+        // Clamp before the cast, a pass that finishes almost instantly makes the estimate huge or NaN
+        if (!(affordable < (double)remaining)) affordable = (double)remaining;
+        if (affordable < 1.0) affordable = 1.0;
+        pass_samples = (int)affordable;
+
+        // Guided and unbudgeted passes double in size, so distributions and previews are refreshed early and often
+        bool doubling = list->guide != NULL || budget >= RENDER_NO_BUDGET;
+        if (doubling && stats->passes < 16 && pass_samples > (1 << stats->passes)) pass_samples = 1 << stats->passes;
+
+        printf("\rRendering pass %d | Samples: %d | Elapsed: %.3fs | Left: %.3fs", stats->passes, done_samples, now - start_time, deadline - now);
+        fflush(stdout);
+    }
+
+    // Report actual per-pixel sample counts and time spent past the budget
+    render_stats_finish(stats);
+    stats->min_samples = fb->samples[0];
+    stats->max_samples = fb->samples[0];
+    for (int k = 1; k < fb->width * fb->height; k++) {
+        if (fb->samples[k] < stats->min_samples) stats->min_samples = fb->samples[k];
+        if (fb->samples[k] > stats->max_samples) stats->max_samples = fb->samples[k];
+    }
+
+    if (order != cam->row_order) free(order);
+    printf("\nImage finished rendering\n");
+}
+
+void render_stats_finish(render_stats *stats) {
+    stats->elapsed = wall_time() - stats->start;
+    stats->overrun = (stats->elapsed > stats->budget) ? stats->elapsed - stats->budget : 0.0;
+}
+
 void sample_square(vec3 *out) {
     (*out)[0] = RAND_DOUBLE - 0.5;
     (*out)[1] = RAND_DOUBLE - 0.5;
@@ -133,6 +404,7 @@ void get_ray(camera *cam, int i, int j, ray *out_ray) {
     // Create out ray
     ray_create(out_ray, &ray_origin, &pixel_sample);
     subtract(&pixel_sample, &ray_origin, &out_ray->direction);
+    out_ray->spread = cam->pixel_spread;
 }
 
 void defocus_disk_sample(camera *cam, point3 *out) {
@@ -143,53 +415,145 @@ void defocus_disk_sample(camera *cam, point3 *out) {
     (*out)[2] = cam->center[2] + (cam->defocus_disk_u[2] * p[0]) + (cam->defocus_disk_v[2] * p[1]);
 }
 
-void ray_color(ray *r, int depth, hittable_list *list, color *out) {
+static void path_color(ray *r, int depth, hittable_list *list, double scatter_pdf, color *out, path_stats *stats) {
     // Check for maximum recursion depth
     if (depth <= 0) {
+        stats->truncated = true;
         (*out)[0] = 0.0;
         (*out)[1] = 0.0;
         (*out)[2] = 0.0;
         return;
     }
 
-    // Initialize hit record with no hit
+    // Hit record is only filled for the closest hit
     hit_record rec;
-    rec.t = -1.0;
-    rec.p[0] = 0.0;
-    rec.p[1] = 0.0;
-    rec.p[2] = 0.0;
-    rec.normal[0] = 0.0;
-    rec.normal[1] = 0.0;
-    rec.normal[2] = 0.0;
-
-    // Return color based on normal if ray hits an object
+    hit_query query;
+
+    // Shade the hit or fall back to the background
     interval ray_t = {0.001, INFINITY};
-    if (hit(list, r, &ray_t, &rec)) {
-        ray scattered;
-        color attenuation;
-        if (rec.mat->scatter(r, &rec, &attenuation, &scattered)) {
-            if (rec.mat == NULL) {
-            fprintf(stderr, "ERROR: rec.mat is NULL at t=%f\n", rec.t);
-            exit(EXIT_FAILURE);
-            }
-            if (rec.mat->scatter == NULL) {
-                fprintf(stderr, "ERROR: rec.mat->scatter is NULL at t=%f\n", rec.t);
-                exit(EXIT_FAILURE);
-            }
+    bool found = closest_hit(list, r, &ray_t, &query, &stats->tests);
+    if (stats->segments++ == 0 && found) stats->primary_id = query.id;
+    if (found) {
+        hit_attributes(list, r, &query, &rec);
+        ray_color_hit(r, &rec, depth, list, out, stats);
+        return;
+    }
+    background(list, r, out);
+
+    // A diffuse bounce already sampled the environment, weight this path against it
+    environment *env = list->environment;
+    if (scatter_pdf > 0.0 && env != NULL && env->importance) {
+        double light_pdf = environment_pdf(env, &r->direction);
+        multiply(out, (scatter_pdf * scatter_pdf) / ((scatter_pdf * scatter_pdf) + (light_pdf * light_pdf)), out);
+    }
+}
 
-            // Recursively get color from scattered ray
-            color scattered_color;
-            ray_color(&scattered, depth - 1, list, &scattered_color);
+void ray_color(ray *r, int depth, hittable_list *list, color *out, path_stats *stats) {
+    path_color(r, depth, list, 0.0, out, stats);
+}
+
+static double continuation_pdf(hittable_list *list, guide_cell *cell, hit_record *rec, vec3 *unit_direction) {
+    // Density of the next direction at a diffuse bounce, cosine lobe mixed with the guide
+    double cosine_pdf = fmax(dot(unit_direction, &rec->normal), 0.0) / PI;
+    if (cell == NULL) return cosine_pdf;
+    double fraction = list->guide->fraction;
+    return (fraction * guide_pdf(cell, unit_direction)) + ((1.0 - fraction) * cosine_pdf);
+}
 
-            // Scale scattered color by attenuation
-            (*out)[0] = attenuation[0] * scattered_color[0];
-            (*out)[1] = attenuation[1] * scattered_color[1];
-            (*out)[2] = attenuation[2] * scattered_color[2];
+static void sample_environment(hittable_list *list, hit_record *rec, guide_cell *cell, color *out, path_stats *stats) {
+    create(out, 0.0, 0.0, 0.0);
+
+    // Pick a direction from the map and skip it if it is below the surface or blocked
+    vec3 direction;
+    color radiance;
+    double light_pdf = environment_sample(list->environment, &direction, &radiance);
+    double cosine = dot(&direction, &rec->normal);
+    if (light_pdf <= 0.0 || cosine <= 0.0) return;
+    ray shadow;
+    ray_create(&shadow, &rec->p, &direction);
+    interval shadow_t = {0.001, INFINITY};
+    if (any_hit(list, &shadow, &shadow_t, &stats->tests)) return;
+
+    // Lambertian response, weighted by the power heuristic against the continuation
+    double scatter_pdf = continuation_pdf(list, cell, rec, &direction);
+    double weight = (light_pdf * light_pdf) / ((light_pdf * light_pdf) + (scatter_pdf * scatter_pdf));
+    double scale = (cosine / PI) * weight / light_pdf;
+    for (int axis = 0; axis < 3; axis++) (*out)[axis] = rec->albedo[axis] * radiance[axis] * scale;
+}
+
+static bool guide_scatter(hittable_list *list, hit_record *rec, guide_cell *cell, color *attenuation, ray *scattered, double *pdf) {
+    // One-sample MIS, take the guide's direction or keep the cosine sample already drawn
+    if (RAND_DOUBLE < list->guide->fraction) guide_sample(cell, &scattered->direction);
+    vec3 unit_direction;
+    unit_vector(&scattered->direction, &unit_direction);
+    double cosine = dot(&unit_direction, &rec->normal);
+    if (cosine <= 0.0) return false;
+    *pdf = continuation_pdf(list, cell, rec, &unit_direction);
+    multiply(&rec->albedo, (cosine / PI) / *pdf, attenuation);
+    return true;
+}
+
+static double luminance(color *c) {
+    return (0.2126 * (*c)[0]) + (0.7152 * (*c)[1]) + (0.0722 * (*c)[2]);
+}
+
+void ray_color_hit(ray *r, hit_record *rec, int depth, hittable_list *list, color *out, path_stats *stats) {
+    ray scattered;
+    color attenuation;
+    if (rec->mat == NULL) {
+        fprintf(stderr, "ERROR: rec.mat is NULL at t=%f\n", rec->t);
+        exit(EXIT_FAILURE);
+    }
+
+    if (material_scatter(r, rec, &attenuation, &scattered)) {
+        // Diffuse bounces can follow the learned guide and sample the environment directly
+        color direct = {0.0, 0.0, 0.0};
+        double scatter_pdf = 0.0;
+        double sample_pdf = 0.0;
+        bool diffuse = rec->mat->type == LAMBERTIAN;
+        guide *g = diffuse ? list->guide : NULL;
+        guide_cell *cell = (g != NULL) ? guide_lookup(g, &rec->p) : NULL;
+        environment *env = list->environment;
+        bool light = diffuse && env != NULL && env->importance;
+        bool below = false; // Guided direction points into the surface and ends the path
+        if (cell != NULL) {
+            below = guide_scatter(list, rec, cell, &attenuation, &scattered, &sample_pdf) == false;
+        } else if (light || g != NULL) {
+            vec3 unit_direction;
+            unit_vector(&scattered.direction, &unit_direction);
+            sample_pdf = continuation_pdf(list, NULL, rec, &unit_direction);
+        }
+        if (light) {
+            sample_environment(list, rec, cell, &direct, stats);
+            scatter_pdf = sample_pdf;
+        }
+        if (below) {
+            create(out, direct[0], direct[1], direct[2]);
             return;
         }
 
-        // If material does not scatter, return background color
-        create(out, 0.0, 0.0, 0.0);
+        // Recursively get color from scattered ray
+        color scattered_color;
+        path_color(&scattered, depth - 1, list, scatter_pdf, &scattered_color, stats);
+
+        // Incoming radiance over the density it was sampled with trains the guide, unless the depth limit cut it short
+        if (g != NULL && sample_pdf > 0.0 && stats->truncated == false) guide_record(g, &rec->p, &scattered.direction, luminance(&scattered_color) / sample_pdf);
+
+        // Scale scattered color by attenuation
+        (*out)[0] = direct[0] + (attenuation[0] * scattered_color[0]);
+        (*out)[1] = direct[1] + (attenuation[1] * scattered_color[1]);
+        (*out)[2] = direct[2] + (attenuation[2] * scattered_color[2]);
+        return;
+    }
+
+    // If material does not scatter, return background color
+    create(out, 0.0, 0.0, 0.0);
+}
+
+void background(hittable_list *list, ray *r, color *out) {
+    // Environment map when one is attached
+    if (list->environment != NULL) {
+        environment_lookup(list->environment, &r->direction, out);
         return;
     }
 
@@ -1,15 +1,24 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "band_writer.h"
+#include "framebuffer.h"
 #include "object.h"
 
 /* CAMERA DEFINITION */
 
+struct gbuffer; // Forward declaration
+struct render_profile; // Forward declaration
+
+// Receives each preview image at 1/scale resolution, scale is 1 for the full passes
+typedef void (*preview_callback)(framebuffer *image, int scale, void *user);
+
 typedef struct {
     // Sample parameters
     double pixel_samples_scale;
     int samples_per_pixel;
     int max_depth;
+    uint64_t seed;
 
     // Viewport parameters
     double aspect_ratio;
@@ -31,13 +40,58 @@ typedef struct {
     vec3 viewport_v;
     vec3 delta_u;
     vec3 delta_v;
+    double pixel_spread; // Primary ray cone angle for texture filtering
+
+    // Optional cache of primary hits, NULL when disabled
+    struct gbuffer *gbuffer;
+
+    // Optional per-pixel cost recording, NULL when disabled
+    struct render_profile *profile;
+
+    // Optional budget render row order, most expensive rows first, NULL for interleaved rows
+    int *row_order;
+
+    // Optional coarse images streamed before and between budget passes, NULL when disabled
+    preview_callback preview;
+    void *preview_user;
+    int preview_depth; // Depth cap while previewing, deeper paths are shown but not kept
 } camera;
 
+/* RENDER STATISTICS DEFINITION */
+
+#define RENDER_NO_BUDGET 1e9 // Budget for progressive renders that take every sample
+
+// Work done by one sample, carried down its path so tracing keeps no shared state
+typedef struct {
+    int segments; // Rays traced, the primary ray included
+    uint32_t primary_id; // PROFILE_MISS when the primary ray escaped
+    bool truncated; // A bounce ran into the depth limit
+    uint64_t tests; // Ray-box and ray-primitive tests
+} path_stats;
+
+typedef struct {
+    double budget;
+    double start; // Wall time the render began
+    double elapsed; // Up to the last render_stats_finish, which callers repeat once the image is written
+    double overrun; // Seconds spent past the budget, zero when on time
+    int passes;
+    long long samples;
+    int min_samples;
+    int max_samples;
+} render_stats;
+
+double wall_time(void);
 void camera_create(camera *cam, point3 *lookfrom, point3 *lookat, vec3 *vup, double defocus_angle, double focus_dist, int samples_per_pixel, int max_depth, double vfov, double aspect_ratio, int image_width);
 void camera_render(camera *cam, hittable_list *list, FILE *image);
+void camera_render_budget(camera *cam, hittable_list *list, framebuffer *fb, double budget, render_stats *stats);
+void render_stats_finish(render_stats *stats);
+void camera_render_bands(camera *cam, hittable_list *list, band_writer *writer);
+void camera_sample(camera *cam, hittable_list *list, int i, int j, int s, color *out, path_stats *stats);
 void get_ray(camera *cam, int i, int j, ray *out_ray);
 void sample_square(vec3 *out);
 void defocus_disk_sample(camera *cam, point3 *out);
-void ray_color(ray *r, int depth, hittable_list *list, color *out);
+void ray_color(ray *r, int depth, hittable_list *list, color *out, path_stats *stats);
+void ray_color_hit(ray *r, hit_record *rec, int depth, hittable_list *list, color *out, path_stats *stats);
+void background(hittable_list *list, ray *r, color *out);
 
 #endif
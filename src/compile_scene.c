@@ -0,0 +1,57 @@
+#include <string.h>
+
+#include "bvh.h"
+#include "camera.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "thread_pool.h"
+
+int main(int argc, char **argv) {
+    /* OPTIONS */
+
+    // Stock scene by default, a random field of spheres or the texture scene
+    char *output_path = NULL;
+    char *image_path = NULL;
+    int sphere_count = 0;
+    bool textured = false;
+    int threads = cpu_count();
+    bool usage = false;
+    for (int k = 1; k < argc; k++) {
+        if (strcmp(argv[k], "--spheres") == 0 && k + 1 < argc) sphere_count = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--textures") == 0) textured = true;
+        else if (strcmp(argv[k], "--image") == 0 && k + 1 < argc) image_path = argv[++k];
+        else if (strcmp(argv[k], "--threads") == 0 && k + 1 < argc) threads = atoi(argv[++k]);
+        else if (output_path == NULL && argv[k][0] != '-') output_path = argv[k];
+        else usage = true;
+    }
+    if (usage || output_path == NULL) {
+        fprintf(stderr, "Usage: %s [--spheres n | --textures [--image file]] [--threads n] output.scene\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* BUILD SCENE */
+
+    double start_time = wall_time();
+    hittable_list scene;
+    hittable_list_create(&scene);
+    if (textured) texture_scene(&scene, image_path);
+    else if (sphere_count > 0) random_scene(&scene, sphere_count);
+    else stock_scene(&scene);
+    double build_time = wall_time();
+    bvh_build_threads(&scene, threads);
+    double bvh_time = wall_time();
+
+    /* WRITE SCENE */
+
+    if (scene_cache_save(&scene, output_path) == false) {
+        fprintf(stderr, "Could not write compiled scene %s\n", output_path);
+        return EXIT_FAILURE;
+    }
+    double write_time = wall_time();
+
+    printf("Compiled %d primitives, %d materials, %d textures, %d bvh nodes\n", primitive_count(&scene) + scene.plane_count, scene.material_count, scene.texture_count, scene.node_count);
+    printf("Scene: %.1f ms | BVH: %.1f ms on %d threads, SAH cost %.2f | Write: %.1f ms\n", (build_time - start_time) * 1000.0, (bvh_time - build_time) * 1000.0, threads, bvh_cost(&scene), (write_time - bvh_time) * 1000.0);
+
+    hittable_list_free(&scene);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,338 @@
+#include <string.h>
+
+#include "bvh.h"
+#include "camera.h"
+#include "environment.h"
+#include "gbuffer.h"
+#include "guide.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "texture_cache.h"
+
+/* CONVERGENCE DEFINITION */
+
+#define MAX_POINTS       64
+#define FIREFLY_FRACTION 0.001 // Share of the worst pixels left out of the robust metric
+
+typedef struct {
+    double target; // Samples per pixel or seconds, depending on the sweep
+    int min_samples;
+    int max_samples;
+    double time;
+    double rmse;
+    double relmse;
+    double robust_rmse;
+} convergence_point;
+
+static int parse_list(char *text, double *values) {
+    // Comma separated numbers, e.g. 1,2,4,8
+    int count = 0;
+    for (char *token = strtok(text, ","); token != NULL && count < MAX_POINTS; token = strtok(NULL, ",")) {
+        double value = atof(token);
+        if (value > 0.0) values[count++] = value;
+    }
+    return count;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void measure_error(framebuffer *fb, framebuffer *reference, convergence_point *point) {
+    // Errors are taken on linear radiance, before gamma and clamping
+    int pixels = fb->width * fb->height;
+    double *errors = malloc((size_t)pixels * sizeof(double));
+    if (errors == NULL) {
+        fprintf(stderr, "Memory allocation failed for errors\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double squared = 0.0;
+    double relative = 0.0;
+    int *rows = framebuffer_nearest_rows(fb);
+    for (int j = 0; j < fb->height; j++) {
+        for (int i = 0; i < fb->width; i++) {
+            color c, r;
+            framebuffer_resolve(fb, rows, i, j, &c);
+            framebuffer_get(reference, i, j, &r);
+
+            double pixel_error = 0.0;
+            for (int axis = 0; axis < 3; axis++) {
+                double d = c[axis] - r[axis];
+                pixel_error += d * d;
+                relative += (d * d) / ((r[axis] * r[axis]) + 0.01);
+            }
+            squared += pixel_error;
+            errors[(j * fb->width) + i] = pixel_error;
+        }
+    }
+    free(rows);
+    point->rmse = sqrt(squared / (3.0 * pixels));
+    point->relmse = relative / (3.0 * pixels);
+
+    // Drop the worst pixels so a single firefly does not dominate the curve
+    qsort(errors, (size_t)pixels, sizeof(double), compare_double);
+    int kept = pixels - (int)(pixels * FIREFLY_FRACTION);
+    double robust = 0.0;
+    for (int k = 0; k < kept; k++) robust += errors[k];
+    point->robust_rmse = sqrt(robust / (3.0 * kept));
+
+    free(errors);
+}
+
+static uint64_t reference_key(camera *cam, hittable_list *list, int max_depth, const char *environment_path, double environment_intensity) {
+    // Camera and geometry, then everything else that changes the converged image
+    uint64_t hash = scene_hash(cam, list);
+    hash = hash_bytes(hash, &cam->samples_per_pixel, sizeof(cam->samples_per_pixel));
+    hash = hash_bytes(hash, &max_depth, sizeof(max_depth));
+    hash = hash_bytes(hash, list->materials, sizeof(material) * (size_t)list->material_count);
+    hash = hash_bytes(hash, list->textures, sizeof(texture) * (size_t)list->texture_count);
+    if (environment_path != NULL) {
+        hash = hash_bytes(hash, environment_path, strlen(environment_path));
+        hash = hash_bytes(hash, &environment_intensity, sizeof(environment_intensity));
+    }
+    return hash;
+}
+
+static bool load_reference(framebuffer *reference, const char *path, const char *key_path, uint64_t key, int width, int height) {
+    // The sidecar names the configuration the reference was rendered with
+    FILE *file = fopen(key_path, "r");
+    if (file == NULL) return false;
+    unsigned long long stored;
+    bool matches = fscanf(file, "%llx", &stored) == 1 && (uint64_t)stored == key;
+    fclose(file);
+    if (matches == false) return false;
+
+    file = fopen(path, "rb");
+    if (file == NULL) return false;
+    bool loaded = framebuffer_read_pfm(reference, file);
+    fclose(file);
+    if (loaded && (reference->width != width || reference->height != height)) {
+        framebuffer_free(reference);
+        loaded = false;
+    }
+    return loaded;
+}
+
+static bool save_reference_key(const char *key_path, uint64_t key, camera *cam, int max_depth, const char *environment_path, double environment_intensity) {
+    FILE *file = fopen(key_path, "w");
+    if (file == NULL) return false;
+    fprintf(file, "%016llx width=%d height=%d spp=%d depth=%d", (unsigned long long)key, cam->image_width, cam->image_height, cam->samples_per_pixel, max_depth);
+    if (environment_path != NULL) fprintf(file, " environment=%s intensity=%g", environment_path, environment_intensity);
+    fprintf(file, "\n");
+    return fclose(file) == 0;
+}
+
+static void write_json_string(FILE *out, const char *text) {
+    // Quotes, backslashes and control characters are escaped
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') fprintf(out, "\\%c", *c);
+        else if (*c < 0x20) fprintf(out, "\\u%04x", *c);
+        else fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+static void write_curve(FILE *out, bool json, const char *label, uint64_t seed, bool budget_sweep, convergence_point *points, int count) {
+    if (json) {
+        fprintf(out, "{\"label\": ");
+        write_json_string(out, label);
+        fprintf(out, ", \"seed\": %llu, \"sweep\": \"%s\", \"points\": [\n", (unsigned long long)seed, budget_sweep ? "budget" : "spp");
+        for (int k = 0; k < count; k++) {
+            convergence_point *p = &points[k];
+            fprintf(out, "  {\"target\": %g, \"min_spp\": %d, \"max_spp\": %d, \"time\": %.6f, \"rmse\": %.8g, \"relmse\": %.8g, \"robust_rmse\": %.8g}%s\n", p->target, p->min_samples, p->max_samples, p->time, p->rmse, p->relmse, p->robust_rmse, (k + 1 < count) ? "," : "");
+        }
+        fprintf(out, "]}\n");
+        return;
+    }
+
+    fprintf(out, "label,seed,sweep,target,min_spp,max_spp,time,rmse,relmse,robust_rmse\n");
+    for (int k = 0; k < count; k++) {
+        convergence_point *p = &points[k];
+        fprintf(out, "%s,%llu,%s,%g,%d,%d,%.6f,%.8g,%.8g,%.8g\n", label, (unsigned long long)seed, budget_sweep ? "budget" : "spp", p->target, p->min_samples, p->max_samples, p->time, p->rmse, p->relmse, p->robust_rmse);
+    }
+}
+
+int main(int argc, char **argv) {
+    /* OPTIONS */
+
+    char *reference_path = "reference.pfm";
+    char *output_path = "convergence.csv";
+    char *scene_path = NULL;
+    char *label = "default";
+    char *environment_path = NULL;
+    double environment_intensity = 1.0;
+    bool environment_sampling = true;
+    bool guiding = false;
+    int reference_samples = 1024;
+    int image_width = 400;
+    int max_depth = 50;
+    uint64_t seed = 1;
+    bool json = false;
+    bool budget_sweep = false;
+    bool usage = false;
+
+    // Default sweep doubles the sample count
+    char default_spp[] = "1,2,4,8,16,32,64";
+    double targets[MAX_POINTS];
+    int target_count = parse_list(default_spp, targets);
+
+    for (int k = 1; k < argc; k++) {
+        if (strcmp(argv[k], "--reference") == 0 && k + 1 < argc) reference_path = argv[++k];
+        else if (strcmp(argv[k], "--reference-spp") == 0 && k + 1 < argc) reference_samples = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--width") == 0 && k + 1 < argc) image_width = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--depth") == 0 && k + 1 < argc) max_depth = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--seed") == 0 && k + 1 < argc) seed = strtoull(argv[++k], NULL, 10);
+        else if (strcmp(argv[k], "--label") == 0 && k + 1 < argc) label = argv[++k];
+        else if (strcmp(argv[k], "--scene") == 0 && k + 1 < argc) scene_path = argv[++k];
+        else if (strcmp(argv[k], "--output") == 0 && k + 1 < argc) output_path = argv[++k];
+        else if (strcmp(argv[k], "--json") == 0) json = true;
+        else if (strcmp(argv[k], "--environment") == 0 && k + 1 < argc) environment_path = argv[++k];
+        else if (strcmp(argv[k], "--environment-intensity") == 0 && k + 1 < argc) environment_intensity = atof(argv[++k]);
+        else if (strcmp(argv[k], "--no-environment-sampling") == 0) environment_sampling = false;
+        else if (strcmp(argv[k], "--guide") == 0) guiding = true;
+        else if (strcmp(argv[k], "--spp") == 0 && k + 1 < argc) {
+            target_count = parse_list(argv[++k], targets);
+            budget_sweep = false;
+        } else if (strcmp(argv[k], "--budgets") == 0 && k + 1 < argc) {
+            target_count = parse_list(argv[++k], targets);
+            budget_sweep = true;
+        } else usage = true;
+    }
+    if (usage || target_count == 0 || image_width <= 0 || reference_samples <= 0) {
+        fprintf(stderr, "Usage: %s [--spp n,n,... | --budgets s,s,...] [--reference file.pfm] [--reference-spp n] [--width w] [--depth d] [--seed n] [--label name] [--scene file] [--output file] [--json] [--environment file.pfm [--environment-intensity x] [--no-environment-sampling]] [--guide]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* SCENE SETUP */
+
+    hittable_list scene;
+    if (scene_path != NULL) {
+        if (scene_cache_load(&scene, scene_path, false) == false) {
+            fprintf(stderr, "Could not load compiled scene %s\n", scene_path);
+            return EXIT_FAILURE;
+        }
+    } else {
+        hittable_list_create(&scene);
+        stock_scene(&scene);
+        bvh_build(&scene);
+    }
+    texture_cache textures;
+    bool textures_loaded = false;
+    if (scene.texture_count > 0) {
+        if (texture_cache_create(&textures, &scene, 64 * 1000 * 1000) == false) return EXIT_FAILURE;
+        textures_loaded = true;
+    }
+    environment env;
+    if (environment_path != NULL) {
+        if (environment_load(&env, environment_path, environment_intensity) == false) {
+            fprintf(stderr, "Could not load environment %s\n", environment_path);
+            return EXIT_FAILURE;
+        }
+        scene.environment = &env;
+    }
+
+    /* REFERENCE */
+
+    // Rendered once with its own seed so its noise is independent of every measured run
+    camera cam;
+    stock_camera(&cam, image_width, reference_samples, max_depth);
+    cam.seed = 0x5EEDF00DULL;
+    uint64_t key = reference_key(&cam, &scene, max_depth, environment_path, environment_intensity);
+    size_t key_path_size = strlen(reference_path) + sizeof(".key");
+    char *key_path = malloc(key_path_size);
+    if (key_path == NULL) {
+        fprintf(stderr, "Memory allocation failed for reference key path\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(key_path, key_path_size, "%s.key", reference_path);
+
+    framebuffer reference;
+    if (load_reference(&reference, reference_path, key_path, key, cam.image_width, cam.image_height)) {
+        printf("Using reference %s\n", reference_path);
+    } else {
+        printf("Rendering reference %s at %d samples per pixel\n", reference_path, reference_samples);
+        render_stats stats;
+        framebuffer_create(&reference, cam.image_width, cam.image_height);
+        camera_render_budget(&cam, &scene, &reference, RENDER_NO_BUDGET, &stats);
+
+        FILE *file = fopen(reference_path, "wb");
+        if (file == NULL) {
+            fprintf(stderr, "Could not write reference %s\n", reference_path);
+            return EXIT_FAILURE;
+        }
+        framebuffer_write_pfm(&reference, file);
+        fclose(file);
+        if (save_reference_key(key_path, key, &cam, max_depth, environment_path, environment_intensity) == false) {
+            fprintf(stderr, "Could not write reference key %s\n", key_path);
+            return EXIT_FAILURE;
+        }
+
+        // Compare against the stored float image so fresh and reused references agree
+        framebuffer_free(&reference);
+        if (load_reference(&reference, reference_path, key_path, key, cam.image_width, cam.image_height) == false) {
+            fprintf(stderr, "Could not read back reference %s\n", reference_path);
+            return EXIT_FAILURE;
+        }
+    }
+    free(key_path);
+
+    /* SWEEP */
+
+    // Sampling only changes the noise, so the reference always uses it
+    if (environment_path != NULL) env.importance = env.importance && environment_sampling;
+
+    // Every point restarts from the same seed, so curves from different builds are comparable
+    convergence_point points[MAX_POINTS];
+    for (int k = 0; k < target_count; k++) {
+        int samples = budget_sweep ? reference_samples : (int)targets[k];
+        double budget = budget_sweep ? targets[k] : RENDER_NO_BUDGET;
+        stock_camera(&cam, image_width, samples, max_depth);
+        cam.seed = seed;
+
+        framebuffer fb;
+        render_stats stats;
+        framebuffer_create(&fb, cam.image_width, cam.image_height);
+
+        // Each point learns its own guide from scratch, inside its own budget
+        guide paths;
+        if (guiding) {
+            guide_create(&paths, &scene);
+            scene.guide = &paths;
+        }
+        camera_render_budget(&cam, &scene, &fb, budget, &stats);
+        if (guiding) {
+            scene.guide = NULL;
+            guide_free(&paths);
+        }
+
+        convergence_point *p = &points[k];
+        p->target = targets[k];
+        p->min_samples = stats.min_samples;
+        p->max_samples = stats.max_samples;
+        p->time = stats.elapsed;
+        measure_error(&fb, &reference, p);
+        framebuffer_free(&fb);
+        printf("Target: %g | Time: %.3fs | RMSE: %.5f | relMSE: %.5f | Robust RMSE: %.5f\n", p->target, p->time, p->rmse, p->relmse, p->robust_rmse);
+    }
+
+    /* WRITE CURVE */
+
+    FILE *out = fopen(output_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Could not write %s\n", output_path);
+        return EXIT_FAILURE;
+    }
+    write_curve(out, json, label, seed, budget_sweep, points, target_count);
+    fclose(out);
+
+    framebuffer_free(&reference);
+    if (textures_loaded) texture_cache_free(&textures);
+    if (environment_path != NULL) environment_free(&env);
+    if (scene_path != NULL) scene_cache_unload(&scene);
+    else hittable_list_free(&scene);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,165 @@
+#include <string.h>
+
+#include "environment.h"
+#include "framebuffer.h"
+
+/* ENVIRONMENT DEFINITION */
+
+static double luminance(float *rgb) {
+    return (0.2126 * rgb[0]) + (0.7152 * rgb[1]) + (0.0722 * rgb[2]);
+}
+
+static double texel_weight(environment *env, int index) {
+    // Rows near the poles cover less solid angle
+    int row = index / env->width;
+    double theta = PI * (row + 0.5) / env->height;
+    return luminance(&env->texels[(size_t)index * 3]) * sin(theta);
+}
+
+static void build_alias_table(environment *env) {
+    // Vose's method, every texel ends up with one alias and a threshold
+    int n = env->width * env->height;
+    env->alias_prob = malloc((size_t)n * sizeof(float));
+    env->alias_index = malloc((size_t)n * sizeof(uint32_t));
+    double *scaled = malloc((size_t)n * sizeof(double));
+    uint32_t *small = malloc((size_t)n * sizeof(uint32_t));
+    uint32_t *large = malloc((size_t)n * sizeof(uint32_t));
+    if (env->alias_prob == NULL || env->alias_index == NULL || scaled == NULL || small == NULL || large == NULL) {
+        fprintf(stderr, "Memory allocation failed for environment sampling\n");
+        exit(EXIT_FAILURE);
+    }
+
+    env->total_weight = 0.0;
+    for (int k = 0; k < n; k++) {
+        scaled[k] = texel_weight(env, k);
+        env->total_weight += scaled[k];
+    }
+
+    int small_count = 0, large_count = 0;
+    for (int k = 0; k < n; k++) {
+        scaled[k] = (env->total_weight > 0.0) ? scaled[k] * n / env->total_weight : 1.0;
+        if (scaled[k] < 1.0) small[small_count++] = (uint32_t)k;
+        else large[large_count++] = (uint32_t)k;
+    }
+
+    // Pair each light texel with a heavy one that fills the rest of its bucket
+    while (small_count > 0 && large_count > 0) {
+        uint32_t s = small[--small_count];
+        uint32_t l = large[--large_count];
+        env->alias_prob[s] = (float)scaled[s];
+        env->alias_index[s] = l;
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+        if (scaled[l] < 1.0) small[small_count++] = l;
+        else large[large_count++] = l;
+    }
+
+    // Leftovers are full buckets up to rounding
+    while (large_count > 0) {
+        uint32_t l = large[--large_count];
+        env->alias_prob[l] = 1.0f;
+        env->alias_index[l] = l;
+    }
+    while (small_count > 0) {
+        uint32_t s = small[--small_count];
+        env->alias_prob[s] = 1.0f;
+        env->alias_index[s] = s;
+    }
+
+    free(scaled);
+    free(small);
+    free(large);
+}
+
+bool environment_load(environment *env, const char *path, double intensity) {
+    memset(env, 0, sizeof(*env));
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return false;
+    framebuffer fb;
+    bool loaded = framebuffer_read_pfm(&fb, file);
+    fclose(file);
+    if (loaded == false) return false;
+
+    // Keep the radiance as floats, the map is only read from now on
+    env->width = fb.width;
+    env->height = fb.height;
+    env->texels = malloc((size_t)env->width * (size_t)env->height * 3 * sizeof(float));
+    if (env->texels == NULL) {
+        fprintf(stderr, "Memory allocation failed for environment\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int j = 0; j < env->height; j++) {
+        for (int i = 0; i < env->width; i++) {
+            color c;
+            framebuffer_get(&fb, i, j, &c);
+            float *texel = &env->texels[(((size_t)j * env->width) + i) * 3];
+            texel[0] = (float)(c[0] * intensity);
+            texel[1] = (float)(c[1] * intensity);
+            texel[2] = (float)(c[2] * intensity);
+        }
+    }
+    framebuffer_free(&fb);
+
+    build_alias_table(env);
+    env->importance = env->total_weight > 0.0;
+    return true;
+}
+
+void environment_free(environment *env) {
+    free(env->texels);
+    free(env->alias_prob);
+    free(env->alias_index);
+    memset(env, 0, sizeof(*env));
+}
+
+static int direction_texel(environment *env, vec3 *direction, double *sin_theta) {
+    // Same longitude convention as sphere texture coordinates
+    vec3 d;
+    unit_vector(direction, &d);
+    double theta = acos(fmin(fmax(d[1], -1.0), 1.0));
+    double phi = atan2(-d[2], d[0]) + PI;
+    int x = (int)(phi / (2.0 * PI) * env->width);
+    int y = (int)(theta / PI * env->height);
+    if (x >= env->width) x = env->width - 1;
+    if (y >= env->height) y = env->height - 1;
+    *sin_theta = sin(theta);
+    return (y * env->width) + x;
+}
+
+void environment_lookup(environment *env, vec3 *direction, color *out) {
+    double sin_theta;
+    float *texel = &env->texels[(size_t)direction_texel(env, direction, &sin_theta) * 3];
+    create(out, texel[0], texel[1], texel[2]);
+}
+
+static double texel_pdf(environment *env, int index, double sin_theta) {
+    // Texel probability spread uniformly over its area in the map, converted to solid angle
+    if (sin_theta <= 0.0 || env->total_weight <= 0.0) return 0.0;
+    double n = (double)env->width * (double)env->height;
+    return texel_weight(env, index) * n / (env->total_weight * 2.0 * PI * PI * sin_theta);
+}
+
+double environment_pdf(environment *env, vec3 *direction) {
+    double sin_theta;
+    int index = direction_texel(env, direction, &sin_theta);
+    return texel_pdf(env, index, sin_theta);
+}
+
+double environment_sample(environment *env, vec3 *direction, color *radiance) {
+    // Constant time pick of a texel from the alias table
+    int n = env->width * env->height;
+    int index = (int)(RAND_DOUBLE * n);
+    if (index >= n) index = n - 1;
+    if (RAND_DOUBLE >= env->alias_prob[index]) index = (int)env->alias_index[index];
+
+    // Uniform point inside the texel
+    double u = ((index % env->width) + RAND_DOUBLE) / env->width;
+    double v = ((index / env->width) + RAND_DOUBLE) / env->height;
+    double phi = u * 2.0 * PI;
+    double theta = v * PI;
+    double sin_theta = sin(theta);
+    create(direction, -sin_theta * cos(phi), cos(theta), sin_theta * sin(phi));
+
+    float *texel = &env->texels[(size_t)index * 3];
+    create(radiance, texel[0], texel[1], texel[2]);
+    return texel_pdf(env, index, sin_theta);
+}
@@ -0,0 +1,27 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "object.h"
+
+/* ENVIRONMENT DEFINITION */
+
+// Equirectangular radiance map, row zero looks straight up
+typedef struct environment {
+    int width;
+    int height;
+    float *texels; // Linear RGB radiance
+    bool importance; // Sample the map explicitly at diffuse bounces
+
+    // Walker alias table over the texels, weighted by luminance and solid angle
+    float *alias_prob;
+    uint32_t *alias_index;
+    double total_weight;
+} environment;
+
+bool environment_load(environment *env, const char *path, double intensity);
+void environment_free(environment *env);
+void environment_lookup(environment *env, vec3 *direction, color *out);
+double environment_pdf(environment *env, vec3 *direction);
+double environment_sample(environment *env, vec3 *direction, color *radiance);
+
+#endif
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "framebuffer.h"
+
+/* FRAMEBUFFER DEFINITION */
+
+void framebuffer_create(framebuffer *fb, int width, int height) {
+    fb->width = width;
+    fb->height = height;
+
+    // Start with every pixel black and unsampled
+    size_t count = (size_t)width * (size_t)height;
+    fb->pixels = calloc(count * 3, sizeof(double));
+    fb->samples = calloc(count, sizeof(int));
+    if (fb->pixels == NULL || fb->samples == NULL) {
+        fprintf(stderr, "Memory allocation failed for framebuffer\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void framebuffer_free(framebuffer *fb) {
+    free(fb->pixels);
+    free(fb->samples);
+    fb->pixels = NULL;
+    fb->samples = NULL;
+}
+
+void framebuffer_add(framebuffer *fb, int i, int j, color *c) {
+    size_t index = ((size_t)j * (size_t)fb->width) + (size_t)i;
+    fb->pixels[(index * 3) + 0] += (*c)[0];
+    fb->pixels[(index * 3) + 1] += (*c)[1];
+    fb->pixels[(index * 3) + 2] += (*c)[2];
+    fb->samples[index]++;
+}
+
+void framebuffer_get(framebuffer *fb, int i, int j, color *out) {
+    // Normalize by the samples this pixel actually received
+    size_t index = ((size_t)j * (size_t)fb->width) + (size_t)i;
+    int samples = fb->samples[index];
+    if (samples == 0) {
+        create(out, 0.0, 0.0, 0.0);
+        return;
+    }
+    double scale = 1.0 / (double)samples;
+    create(out, fb->pixels[(index * 3) + 0] * scale, fb->pixels[(index * 3) + 1] * scale, fb->pixels[(index * 3) + 2] * scale);
+}
+
+int *framebuffer_nearest_rows(framebuffer *fb) {
+    // Row each pixel borrows from, the nearest sampled one in its column, -1 when the column is empty
+    int *rows = malloc(sizeof(int) * (size_t)fb->width * (size_t)fb->height);
+    int *below = malloc(sizeof(int) * (size_t)fb->width);
+    if (rows == NULL || below == NULL) {
+        fprintf(stderr, "Memory allocation failed for nearest rows\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Downward sweep finds the nearest sampled row above every pixel
+    for (int j = 0; j < fb->height; j++) {
+        for (int i = 0; i < fb->width; i++) {
+            size_t index = ((size_t)j * (size_t)fb->width) + (size_t)i;
+            if (fb->samples[index] > 0) rows[index] = j;
+            else rows[index] = (j > 0) ? rows[index - (size_t)fb->width] : -1;
+        }
+    }
+
+    // Upward sweep takes the row below instead when it is strictly closer
+    for (int i = 0; i < fb->width; i++) below[i] = -1;
+    for (int j = fb->height - 1; j >= 0; j--) {
+        for (int i = 0; i < fb->width; i++) {
+            size_t index = ((size_t)j * (size_t)fb->width) + (size_t)i;
+            if (fb->samples[index] > 0) {
+                below[i] = j;
+                continue;
+            }
+            int above = rows[index];
+            if (below[i] >= 0 && (above < 0 || below[i] - j < j - above)) rows[index] = below[i];
+        }
+    }
+
+    free(below);
+    return rows;
+}
+
+void framebuffer_resolve(framebuffer *fb, int *rows, int i, int j, color *out) {
+    // Unsampled pixels borrow the row picked by framebuffer_nearest_rows
+    int source = rows[((size_t)j * (size_t)fb->width) + (size_t)i];
+    if (source < 0) {
+        create(out, 0.0, 0.0, 0.0);
+        return;
+    }
+    framebuffer_get(fb, i, source, out);
+}
+
+void framebuffer_write_ppm(framebuffer *fb, FILE *image) {
+    // Write PPM header
+    fprintf(image, "P3\n%d %d\n255\n", fb->width, fb->height);
+
+    color pixel_color;
+    int *rows = framebuffer_nearest_rows(fb);
+    for (int j = 0; j < fb->height; j++) {
+        for (int i = 0; i < fb->width; i++) {
+            framebuffer_resolve(fb, rows, i, j, &pixel_color);
+            write_color(image, &pixel_color);
+        }
+    }
+    free(rows);
+}
+
+void framebuffer_write_pfm(framebuffer *fb, FILE *image) {
+    // Little-endian color PFM, rows stored bottom to top
+    fprintf(image, "PF\n%d %d\n-1.0\n", fb->width, fb->height);
+
+    color pixel_color;
+    float row[3];
+    int *rows = framebuffer_nearest_rows(fb);
+    for (int j = fb->height - 1; j >= 0; j--) {
+        for (int i = 0; i < fb->width; i++) {
+            framebuffer_resolve(fb, rows, i, j, &pixel_color);
+            row[0] = (float)pixel_color[0];
+            row[1] = (float)pixel_color[1];
+            row[2] = (float)pixel_color[2];
+            fwrite(row, sizeof(float), 3, image);
+        }
+    }
+    free(rows);
+}
+
+float *read_pfm(FILE *image, int *width, int *height) {
+    // Color PFM as linear RGB rows from the top, a positive scale marks big-endian data
+    char magic[3];
+    double scale;
+    if (fscanf(image, "%2s %d %d %lf", magic, width, height, &scale) != 4) return NULL;
+    if (strcmp(magic, "PF") != 0 || *width <= 0 || *height <= 0 || scale == 0.0) return NULL;
+    fgetc(image); // Single whitespace before the raster
+
+    size_t row_count = (size_t)*width * 3;
+    float *texels = malloc(row_count * (size_t)*height * sizeof(float));
+    if (texels == NULL) {
+        fprintf(stderr, "Memory allocation failed for PFM image\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Rows are stored bottom to top
+    uint32_t probe = 1;
+    bool swap = (scale > 0.0) == (*(unsigned char *)&probe == 1);
+    for (int j = *height - 1; j >= 0; j--) {
+        float *row = texels + ((size_t)j * row_count);
+        if (fread(row, sizeof(float), row_count, image) != row_count) {
+            free(texels);
+            return NULL;
+        }
+        if (swap) {
+            for (size_t k = 0; k < row_count; k++) {
+                uint32_t bits;
+                memcpy(&bits, &row[k], sizeof(bits));
+                bits = (bits >> 24) | ((bits >> 8) & 0xFF00u) | ((bits << 8) & 0xFF0000u) | (bits << 24);
+                memcpy(&row[k], &bits, sizeof(bits));
+            }
+        }
+    }
+    return texels;
+}
+
+bool framebuffer_read_pfm(framebuffer *fb, FILE *image) {
+    int width, height;
+    float *texels = read_pfm(image, &width, &height);
+    if (texels == NULL) return false;
+
+    // Every pixel is loaded as one sample
+    framebuffer_create(fb, width, height);
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            float *t = &texels[(((size_t)j * (size_t)width) + (size_t)i) * 3];
+            color c = {t[0], t[1], t[2]};
+            framebuffer_add(fb, i, j, &c);
+        }
+    }
+    free(texels);
+    return true;
+}
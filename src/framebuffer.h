@@ -0,0 +1,26 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "vector.h"
+
+/* FRAMEBUFFER DEFINITION */
+
+typedef struct {
+    int width;
+    int height;
+    double *pixels; // Accumulated linear color, three values per pixel
+    int *samples; // Samples accumulated in each pixel
+} framebuffer;
+
+void framebuffer_create(framebuffer *fb, int width, int height);
+void framebuffer_free(framebuffer *fb);
+void framebuffer_add(framebuffer *fb, int i, int j, color *c);
+void framebuffer_get(framebuffer *fb, int i, int j, color *out);
+int *framebuffer_nearest_rows(framebuffer *fb);
+void framebuffer_resolve(framebuffer *fb, int *rows, int i, int j, color *out);
+void framebuffer_write_ppm(framebuffer *fb, FILE *image);
+void framebuffer_write_pfm(framebuffer *fb, FILE *image);
+float *read_pfm(FILE *image, int *width, int *height);
+bool framebuffer_read_pfm(framebuffer *fb, FILE *image);
+
+#endif
@@ -0,0 +1,177 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "gbuffer.h"
+
+/* GBUFFER DEFINITION */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;
+    int32_t width;
+    int32_t height;
+    int32_t samples;
+    int32_t compressed;
+} gbuffer_header;
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    // FNV-1a over raw bytes
+    const unsigned char *bytes = data;
+    for (size_t k = 0; k < size; k++) {
+        hash ^= bytes[k];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hash_array(uint64_t hash, const void *array, int count, size_t element_size, size_t geometry_size) {
+    // Hash the geometry of every element, primitives keep their material index last so edits keep the cache
+    const unsigned char *bytes = array;
+    hash = hash_bytes(hash, &count, sizeof(count));
+    for (int k = 0; k < count; k++) hash = hash_bytes(hash, bytes + ((size_t)k * element_size), geometry_size);
+    return hash;
+}
+
+uint64_t scene_hash(camera *cam, hittable_list *list) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    // Everything that decides where primary rays go
+    hash = hash_bytes(hash, &cam->image_width, sizeof(cam->image_width));
+    hash = hash_bytes(hash, &cam->image_height, sizeof(cam->image_height));
+    hash = hash_bytes(hash, &cam->seed, sizeof(cam->seed));
+    hash = hash_bytes(hash, &cam->defocus_angle, sizeof(cam->defocus_angle));
+    hash = hash_bytes(hash, &cam->center, sizeof(cam->center));
+    hash = hash_bytes(hash, &cam->pixel00_loc, sizeof(cam->pixel00_loc));
+    hash = hash_bytes(hash, &cam->delta_u, sizeof(cam->delta_u));
+    hash = hash_bytes(hash, &cam->delta_v, sizeof(cam->delta_v));
+    hash = hash_bytes(hash, &cam->defocus_disk_u, sizeof(cam->defocus_disk_u));
+    hash = hash_bytes(hash, &cam->defocus_disk_v, sizeof(cam->defocus_disk_v));
+
+    // Geometry of every primitive, in array order since ids index the arrays
+    hash = hash_array(hash, list->spheres, list->sphere_count, sizeof(sphere), offsetof(sphere, mat));
+    hash = hash_array(hash, list->quads, list->quad_count, sizeof(quad), offsetof(quad, mat));
+    hash = hash_array(hash, list->boxes, list->box_count, sizeof(box), offsetof(box, mat));
+    hash = hash_array(hash, list->planes, list->plane_count, sizeof(plane), offsetof(plane, mat));
+
+    return hash;
+}
+
+void gbuffer_create(gbuffer *gb, camera *cam, hittable_list *list, int samples, bool compressed) {
+    gb->hash = scene_hash(cam, list);
+    gb->width = cam->image_width;
+    gb->height = cam->image_height;
+    gb->samples = (samples < cam->samples_per_pixel) ? samples : cam->samples_per_pixel;
+    gb->compressed = compressed;
+    gb->valid = false;
+    gb->entry_size = compressed ? sizeof(gbuffer_packed_sample) : sizeof(gbuffer_sample);
+
+    // Memory is bounded by the cached sample count, not the render sample count
+    gb->entries = malloc(gbuffer_size(gb));
+    if (gb->entries == NULL) {
+        fprintf(stderr, "Memory allocation failed for gbuffer\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void gbuffer_free(gbuffer *gb) {
+    free(gb->entries);
+    gb->entries = NULL;
+    gb->valid = false;
+}
+
+size_t gbuffer_size(gbuffer *gb) {
+    return (size_t)gb->width * (size_t)gb->height * (size_t)gb->samples * gb->entry_size;
+}
+
+bool gbuffer_load(gbuffer *gb, FILE *file) {
+    // Only accept a cache made for the same camera, geometry and layout
+    gbuffer_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1) return false;
+    if (header.magic != GBUFFER_MAGIC || header.version != GBUFFER_VERSION) return false;
+    if (header.hash != gb->hash || header.width != gb->width || header.height != gb->height) return false;
+    if (header.samples != gb->samples || header.compressed != (int32_t)gb->compressed) return false;
+
+    gb->valid = fread(gb->entries, gbuffer_size(gb), 1, file) == 1;
+    return gb->valid;
+}
+
+bool gbuffer_save(gbuffer *gb, FILE *file) {
+    if (gb->valid == false) return false;
+    gbuffer_header header = {GBUFFER_MAGIC, GBUFFER_VERSION, gb->hash, gb->width, gb->height, gb->samples, gb->compressed};
+    if (fwrite(&header, sizeof(header), 1, file) != 1) return false;
+    return fwrite(gb->entries, gbuffer_size(gb), 1, file) == 1;
+}
+
+static void *gbuffer_entry(gbuffer *gb, int i, int j, int s) {
+    size_t index = (((size_t)j * (size_t)gb->width + (size_t)i) * (size_t)gb->samples) + (size_t)s;
+    return gb->entries + (index * gb->entry_size);
+}
+
+void gbuffer_store(gbuffer *gb, camera *cam, int i, int j, int s, ray *r, uint32_t id, hit_record *rec) {
+    // The random stream resumes right after the primary ray was generated
+    uint64_t rng = random_get_state();
+
+    if (gb->compressed == false) {
+        gbuffer_sample *entry = gbuffer_entry(gb, i, j, s);
+        memset(entry, 0, sizeof(*entry));
+        entry->id = id;
+        entry->rng = rng;
+        create(&entry->origin, r->origin[0], r->origin[1], r->origin[2]);
+        create(&entry->direction, r->direction[0], r->direction[1], r->direction[2]);
+        if (rec != NULL) entry->t = rec->t;
+        return;
+    }
+
+    gbuffer_packed_sample *entry = gbuffer_entry(gb, i, j, s);
+    memset(entry, 0, sizeof(*entry));
+    entry->id = id;
+    entry->rng = rng;
+    for (int axis = 0; axis < 3; axis++) entry->direction[axis] = (float)r->direction[axis];
+
+    // Store the lens position in disk coordinates instead of the ray origin
+    double defocus_radius = length(&cam->defocus_disk_u);
+    if (defocus_radius > 0.0) {
+        vec3 offset;
+        subtract(&r->origin, &cam->center, &offset);
+        entry->lens[0] = (int16_t)lround((dot(&offset, &cam->u) / defocus_radius) * 32767.0);
+        entry->lens[1] = (int16_t)lround((dot(&offset, &cam->v) / defocus_radius) * 32767.0);
+    }
+
+    if (rec != NULL) entry->t = (float)rec->t;
+}
+
+bool gbuffer_fetch(gbuffer *gb, camera *cam, hittable_list *list, int i, int j, int s, ray *r, hit_record *rec, uint32_t *id) {
+    hit_query query;
+
+    if (gb->compressed == false) {
+        gbuffer_sample *entry = gbuffer_entry(gb, i, j, s);
+        random_set_state(entry->rng);
+        ray_create(r, &entry->origin, &entry->direction);
+        r->spread = cam->pixel_spread;
+        *id = entry->id;
+        if (*id == GBUFFER_MISS) return false;
+        query.t = entry->t;
+    } else {
+        gbuffer_packed_sample *entry = gbuffer_entry(gb, i, j, s);
+        random_set_state(entry->rng);
+
+        // Rebuild the ray origin from the lens position
+        double lx = entry->lens[0] / 32767.0;
+        double ly = entry->lens[1] / 32767.0;
+        for (int axis = 0; axis < 3; axis++) {
+            r->origin[axis] = cam->center[axis] + (cam->defocus_disk_u[axis] * lx) + (cam->defocus_disk_v[axis] * ly);
+            r->direction[axis] = entry->direction[axis];
+        }
+        r->width = 0.0;
+        r->spread = cam->pixel_spread;
+        *id = entry->id;
+        if (*id == GBUFFER_MISS) return false;
+        query.t = entry->t;
+    }
+
+    // Everything past the distance is cheap to rebuild from the ray and the object id
+    query.id = *id;
+    hit_attributes(list, r, &query, rec);
+    return true;
+}
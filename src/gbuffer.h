@@ -0,0 +1,51 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include "camera.h"
+
+/* GBUFFER DEFINITION */
+
+#define GBUFFER_MISS    UINT32_MAX // Primary ray escaped to the background
+#define GBUFFER_MAGIC   0x46554247u // "GBUF"
+#define GBUFFER_VERSION 3
+
+// Full precision sample, replays bit-identical to a normal render
+typedef struct {
+    uint32_t id;
+    uint64_t rng;
+    double t;
+    point3 origin;
+    vec3 direction;
+} gbuffer_sample;
+
+// Quantized sample, lens position packed to 16 bits per component
+typedef struct {
+    uint32_t id;
+    float t;
+    uint64_t rng;
+    float direction[3];
+    int16_t lens[2];
+} gbuffer_packed_sample;
+
+typedef struct gbuffer {
+    uint64_t hash;
+    int width;
+    int height;
+    int samples; // Cached samples per pixel, later samples are traced normally
+    bool compressed;
+    bool valid; // Entries match the current camera and geometry
+    size_t entry_size;
+    unsigned char *entries;
+} gbuffer;
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size);
+uint64_t scene_hash(camera *cam, hittable_list *list);
+void gbuffer_create(gbuffer *gb, camera *cam, hittable_list *list, int samples, bool compressed);
+void gbuffer_free(gbuffer *gb);
+size_t gbuffer_size(gbuffer *gb);
+bool gbuffer_load(gbuffer *gb, FILE *file);
+bool gbuffer_save(gbuffer *gb, FILE *file);
+void gbuffer_store(gbuffer *gb, camera *cam, int i, int j, int s, ray *r, uint32_t id, hit_record *rec);
+bool gbuffer_fetch(gbuffer *gb, camera *cam, hittable_list *list, int i, int j, int s, ray *r, hit_record *rec, uint32_t *id);
+
+#endif
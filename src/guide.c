@@ -0,0 +1,139 @@
+#include <string.h>
+
+#include "guide.h"
+
+/* PATH GUIDE DEFINITION */
+
+void guide_create(guide *g, hittable_list *list) {
+    memset(g, 0, sizeof(*g));
+    bounding_box(list, &g->bounds);
+
+    // Planes are unbounded, points beyond the box fall into the border cells
+    for (int axis = 0; axis < 3; axis++) {
+        double extent = g->bounds.max[axis] - g->bounds.min[axis];
+        g->cell_scale[axis] = (extent > 0.0) ? GUIDE_GRID / extent : 0.0;
+    }
+
+    g->cells = calloc((size_t)GUIDE_GRID * GUIDE_GRID * GUIDE_GRID, sizeof(guide_cell));
+    if (g->cells == NULL) {
+        fprintf(stderr, "Memory allocation failed for path guide\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < GUIDE_LOCKS; k++) pthread_mutex_init(&g->locks[k], NULL);
+    g->fraction = 0.5;
+}
+
+void guide_free(guide *g) {
+    for (int k = 0; k < GUIDE_LOCKS; k++) pthread_mutex_destroy(&g->locks[k]);
+    free(g->cells);
+    memset(g, 0, sizeof(*g));
+}
+
+static int cell_index(guide *g, point3 *p) {
+    int index = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        int c = (int)(((*p)[axis] - g->bounds.min[axis]) * g->cell_scale[axis]);
+        if (c < 0) c = 0;
+        if (c >= GUIDE_GRID) c = GUIDE_GRID - 1;
+        index = (index * GUIDE_GRID) + c;
+    }
+    return index;
+}
+
+static int direction_bin(vec3 *direction) {
+    // Equal area, so every bin covers the same solid angle
+    vec3 d;
+    unit_vector(direction, &d);
+    double phi = atan2(d[2], d[0]);
+    if (phi < 0.0) phi += 2.0 * PI;
+    int x = (int)((d[1] + 1.0) * 0.5 * GUIDE_RESOLUTION);
+    int y = (int)(phi / (2.0 * PI) * GUIDE_RESOLUTION);
+    if (x < 0) x = 0;
+    if (x >= GUIDE_RESOLUTION) x = GUIDE_RESOLUTION - 1;
+    if (y >= GUIDE_RESOLUTION) y = GUIDE_RESOLUTION - 1;
+    return (y * GUIDE_RESOLUTION) + x;
+}
+
+static int level_offset(int level) {
+    // Levels are stored root first, level L holds 4^L nodes
+    return ((1 << (2 * level)) - 1) / 3;
+}
+
+static void build_tree(guide_cell *cell) {
+    // Leaves copy the training bins, every parent sums its four children
+    int leaves = level_offset(4);
+    memcpy(&cell->tree[leaves], cell->training, sizeof(cell->training));
+    for (int level = 3; level >= 0; level--) {
+        int size = 1 << level;
+        float *parent = &cell->tree[level_offset(level)];
+        float *child = &cell->tree[level_offset(level + 1)];
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                int c = (2 * y * 2 * size) + (2 * x);
+                parent[(y * size) + x] = child[c] + child[c + 1] + child[c + (2 * size)] + child[c + (2 * size) + 1];
+            }
+        }
+    }
+    cell->ready = cell->tree[0] > 0.0f;
+}
+
+void guide_update(guide *g) {
+    // Only called between passes, while nothing samples or records
+    int cells = GUIDE_GRID * GUIDE_GRID * GUIDE_GRID;
+    for (int k = 0; k < cells; k++) {
+        guide_cell *cell = &g->cells[k];
+        if (cell->records >= GUIDE_MIN_RECORDS) build_tree(cell);
+    }
+}
+
+guide_cell *guide_lookup(guide *g, point3 *p) {
+    // NULL until the cell has learned enough to sample from
+    guide_cell *cell = &g->cells[cell_index(g, p)];
+    return cell->ready ? cell : NULL;
+}
+
+void guide_record(guide *g, point3 *p, vec3 *direction, double value) {
+    if (!(value > 0.0) || isinf(value)) return;
+    int index = cell_index(g, p);
+    guide_cell *cell = &g->cells[index];
+    pthread_mutex_t *lock = &g->locks[index % GUIDE_LOCKS];
+    pthread_mutex_lock(lock);
+    cell->training[direction_bin(direction)] += (float)value;
+    cell->records++;
+    pthread_mutex_unlock(lock);
+}
+
+void guide_sample(guide_cell *cell, vec3 *direction) {
+    // Walk down the quadtree picking each child by its share of the energy
+    int x = 0, y = 0;
+    for (int level = 1; level <= 4; level++) {
+        int size = 1 << level;
+        float *nodes = &cell->tree[level_offset(level)];
+        x *= 2;
+        y *= 2;
+        float weights[4] = {nodes[(y * size) + x], nodes[(y * size) + x + 1], nodes[((y + 1) * size) + x], nodes[((y + 1) * size) + x + 1]};
+        double pick = RAND_DOUBLE * (weights[0] + weights[1] + weights[2] + weights[3]);
+        int child = 3;
+        for (int k = 0; k < 3; k++) {
+            if (pick < weights[k]) {
+                child = k;
+                break;
+            }
+            pick -= weights[k];
+        }
+        x += child & 1;
+        y += child >> 1;
+    }
+
+    // Uniform point inside the leaf, mapped back to the sphere
+    double cos_theta = (2.0 * (x + RAND_DOUBLE) / GUIDE_RESOLUTION) - 1.0;
+    double phi = 2.0 * PI * (y + RAND_DOUBLE) / GUIDE_RESOLUTION;
+    double sin_theta = sqrt(fmax(0.0, 1.0 - (cos_theta * cos_theta)));
+    create(direction, sin_theta * cos(phi), cos_theta, sin_theta * sin(phi));
+}
+
+double guide_pdf(guide_cell *cell, vec3 *direction) {
+    // Leaf share of the energy spread over the leaf's solid angle of 4 pi / bins
+    double leaf = cell->tree[level_offset(4) + direction_bin(direction)];
+    return leaf * GUIDE_BINS / (cell->tree[0] * 4.0 * PI);
+}
@@ -0,0 +1,41 @@
+#ifndef GUIDE_H
+#define GUIDE_H
+
+#include <pthread.h>
+
+#include "object.h"
+
+/* PATH GUIDE DEFINITION */
+
+#define GUIDE_GRID        16 // Cells along each axis of the scene bounds
+#define GUIDE_RESOLUTION  16 // Direction bins along each side, a full quadtree of depth 4
+#define GUIDE_BINS        (GUIDE_RESOLUTION * GUIDE_RESOLUTION)
+#define GUIDE_TREE_SIZE   341 // Nodes of the quadtree, 1 + 4 + 16 + 64 + 256
+#define GUIDE_LOCKS       64
+#define GUIDE_MIN_RECORDS 64 // Records a cell needs before it is sampled
+
+// Directions use the equal-area cylindrical map, (cos theta, phi) over the unit square
+typedef struct {
+    float training[GUIDE_BINS]; // Radiance over pdf accumulated per bin
+    uint32_t records;
+    float tree[GUIDE_TREE_SIZE]; // Sums of the training bins level by level, root first
+    bool ready;
+} guide_cell;
+
+typedef struct guide {
+    aabb bounds;
+    vec3 cell_scale; // Cells per world unit on each axis
+    guide_cell *cells;
+    double fraction; // Chance of sampling the guide instead of the BSDF at a diffuse bounce
+    pthread_mutex_t locks[GUIDE_LOCKS]; // Striped over the cells so writers rarely meet
+} guide;
+
+void guide_create(guide *g, hittable_list *list);
+void guide_free(guide *g);
+void guide_update(guide *g);
+guide_cell *guide_lookup(guide *g, point3 *p);
+void guide_record(guide *g, point3 *p, vec3 *direction, double value);
+void guide_sample(guide_cell *cell, vec3 *direction);
+double guide_pdf(guide_cell *cell, vec3 *direction);
+
+#endif
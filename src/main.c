@@ -1,111 +1,300 @@
+#include <string.h>
+
 #include "main.h"
+#include "bvh.h"
 #include "camera.h"
+#include "environment.h"
+#include "gbuffer.h"
+#include "guide.h"
 #include "object.h"
+#include "profile.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "texture_cache.h"
 #include "vector.h"
 
-int main(void) {
-    /* SCENE SETUP */
+typedef struct {
+    const char *path;
+    double start_time;
+} preview_file;
 
-    // Create scene
-    hittable_list scene;
-    scene.count = 0;
-
-    // Create ground sphere
-    material ground_material;
-    color ground_color = {0.5, 0.5, 0.5};
-    create_lambertian(&ground_material, &ground_color);
-    add_sphere(&scene, 0.0, -1000.0, 0.0, 1000.0, &ground_material);
-
-    // Create random spheres
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            // Randomly choose material and position
-            double choose_material = RAND_DOUBLE;
-            point3 center;
-            create(&center, a + (0.9 * RAND_DOUBLE), 0.2, b + (0.9 * RAND_DOUBLE));
-
-            
-            // Create sphere based on material choice
-            if (choose_material < 0.8) {
-                // Create lambertian sphere
-                color *albedo = malloc(sizeof(color));
-                create(albedo, RAND_DOUBLE * RAND_DOUBLE, RAND_DOUBLE * RAND_DOUBLE, RAND_DOUBLE * RAND_DOUBLE);
-                material *mat = malloc(sizeof(material));
-                create_lambertian(mat, albedo);
-                add_sphere(&scene, center[0], center[1], center[2], 0.2, mat);
-            } else if (choose_material < 0.95) {
-                // Create metal sphere
-                color *albedo = malloc(sizeof(color));
-                create(albedo, 0.5 * (1 + RAND_DOUBLE), 0.5 * (1 + RAND_DOUBLE), 0.5 * (1 + RAND_DOUBLE));
-                double fuzz = 0.5 * RAND_DOUBLE;
-                material *mat = malloc(sizeof(material));
-                create_metal(mat, albedo, fuzz);
-                add_sphere(&scene, center[0], center[1], center[2], 0.2, mat);
-            } else {
-                // Create dielectric sphere
-                material *mat = malloc(sizeof(material));
-                create_dielectric(mat, 1.5);
-                add_sphere(&scene, center[0], center[1], center[2], 0.2, mat);
-            }
-        }
+static void write_preview(framebuffer *image, int scale, void *user) {
+    // Replace the file in one step so a viewer never reads half an image
+    preview_file *preview = user;
+    size_t length = strlen(preview->path) + 5;
+    char *partial = malloc(length);
+    if (partial == NULL) {
+        fprintf(stderr, "Memory allocation failed for preview path\n");
+        exit(EXIT_FAILURE);
     }
+    snprintf(partial, length, "%s.tmp", preview->path);
+    FILE *file = fopen(partial, "w");
+    if (file != NULL) {
+        framebuffer_write_ppm(image, file);
+        if (fclose(file) == 0) rename(partial, preview->path);
+    }
+    free(partial);
+    if (scale > 1) printf("Preview 1/%d after %.1f ms\n", scale, (wall_time() - preview->start_time) * 1000.0);
+}
 
-    // Add a large dielectric sphere
-    material material1;
-    create_dielectric(&material1, 1.5);
-    add_sphere(&scene, 0.0, 1.0, 0.0, 1.0, &material1);
+int main(int argc, char **argv) {
+    double start_time = wall_time();
 
-    // Add a large metal sphere
-    material material2;
-    color albedo2;
-    create(&albedo2, 0.4, 0.2, 0.1);
-    create_lambertian(&material2, &albedo2);
-    add_sphere(&scene, -4.0, 1.0, 0.0, 1.0, &material2);
+    /* OPTIONS */
 
-    // Add a large metal sphere
-    material material3;
-    color albedo3;
-    create(&albedo3, 0.7, 0.6, 0.5);
-    create_metal(&material3, &albedo3, 0.0);
-    add_sphere(&scene, 4.0, 1.0, 0.0, 1.0, &material3);
+    // Optional compiled scene used in place of the stock scene
+    char *scene_path = NULL;
+    bool scene_verify = false;
 
-    /* SETUP CAMERA */
+    // Optional primary hit cache for material-only re-renders
+    char *gbuffer_path = NULL;
+    int gbuffer_samples = 16;
+    bool gbuffer_compressed = false;
+    double budget = 0.0; // Wall-clock budget in seconds, zero renders every sample
+    double texture_budget = 64.0; // Resident image tiles in MB
 
-    // Set camera position
-    double vfov = 20.0;
-    vec3 lookfrom, lookat, vup;
-    create(&lookfrom, 13.0, 2.0, 3.0);
-    create(&lookat, 0.0, 0.0, 0.0);
-    create(&vup, 0.0, 1.0, 0.0);
+    // Optional HDR environment replacing the sky gradient
+    char *environment_path = NULL;
+    double environment_intensity = 1.0;
+    bool environment_sampling = true;
 
-    // Set camera parameters
-    double aspect_ratio = 16.0 / 9.0;
-    int image_width = 1200;
+    // Learn where light comes from during the first budget passes and sample it later
+    bool guiding = false;
 
-    // Defocus blur parameters
-    double defocus_angle = 0.6;
-    double focus_dist = 10.0;
+    // Optional coarse-to-fine preview streamed to a file
+    char *preview_path = NULL;
 
-    // Set samples per pixel and max depth
+    // Optional band-by-band output for images too large to keep in memory
+    char *stream_path = NULL;
+    int band_height = 16;
+    int queue_depth = 2;
+    int image_width = 1200;
     int samples_per_pixel = 500;
+
+    // Optional per-pixel cost profile, and a previous one used to order budget rows
+    char *profile_prefix = NULL;
+    char *cost_hint_path = NULL;
+    for (int k = 1; k < argc; k++) {
+        if (strcmp(argv[k], "--gbuffer") == 0 && k + 1 < argc) gbuffer_path = argv[++k];
+        else if (strcmp(argv[k], "--gbuffer-samples") == 0 && k + 1 < argc) gbuffer_samples = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--gbuffer-compress") == 0) gbuffer_compressed = true;
+        else if (strcmp(argv[k], "--budget") == 0 && k + 1 < argc) budget = atof(argv[++k]);
+        else if (strcmp(argv[k], "--scene") == 0 && k + 1 < argc) scene_path = argv[++k];
+        else if (strcmp(argv[k], "--verify") == 0) scene_verify = true;
+        else if (strcmp(argv[k], "--texture-cache") == 0 && k + 1 < argc) texture_budget = atof(argv[++k]);
+        else if (strcmp(argv[k], "--environment") == 0 && k + 1 < argc) environment_path = argv[++k];
+        else if (strcmp(argv[k], "--environment-intensity") == 0 && k + 1 < argc) environment_intensity = atof(argv[++k]);
+        else if (strcmp(argv[k], "--no-environment-sampling") == 0) environment_sampling = false;
+        else if (strcmp(argv[k], "--guide") == 0) guiding = true;
+        else if (strcmp(argv[k], "--preview") == 0 && k + 1 < argc) preview_path = argv[++k];
+        else if (strcmp(argv[k], "--stream") == 0 && k + 1 < argc) stream_path = argv[++k];
+        else if (strcmp(argv[k], "--band-height") == 0 && k + 1 < argc) band_height = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--queue-depth") == 0 && k + 1 < argc) queue_depth = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--width") == 0 && k + 1 < argc) image_width = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--samples") == 0 && k + 1 < argc) samples_per_pixel = atoi(argv[++k]);
+        else if (strcmp(argv[k], "--profile") == 0 && k + 1 < argc) profile_prefix = argv[++k];
+        else if (strcmp(argv[k], "--cost-hint") == 0 && k + 1 < argc) cost_hint_path = argv[++k];
+        else {
+            fprintf(stderr, "Usage: %s [--gbuffer file] [--gbuffer-samples n] [--gbuffer-compress] [--budget seconds] [--scene file [--verify]] [--texture-cache MB] [--environment file.pfm [--environment-intensity x] [--no-environment-sampling]] [--guide] [--preview file.ppm] [--stream file.ppm|file.pfm [--band-height n] [--queue-depth n]] [--width w] [--samples n] [--profile prefix] [--cost-hint prefix.pfm]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (image_width <= 0 || samples_per_pixel <= 0 || band_height <= 0 || queue_depth <= 0) {
+        fprintf(stderr, "Width, samples, band height and queue depth must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    // Streamed bands are final when written, so there are no passes to budget or preview
+    if (stream_path != NULL && (budget > 0.0 || preview_path != NULL)) {
+        fprintf(stderr, "Ignoring --budget and --preview, --stream renders every sample band by band\n");
+        budget = 0.0;
+        preview_path = NULL;
+    }
+    if (stream_path != NULL && (profile_prefix != NULL || gbuffer_path != NULL)) {
+        fprintf(stderr, "Ignoring --profile and --gbuffer, --stream does not record per-pixel data\n");
+        profile_prefix = NULL;
+        gbuffer_path = NULL;
+    }
+
+    /* SCENE SETUP */
+
+    // Create scene, either mapped from a compiled file or built in memory
+    hittable_list scene;
+    if (scene_path != NULL) {
+        if (scene_cache_load(&scene, scene_path, scene_verify) == false) {
+            fprintf(stderr, "Could not load compiled scene %s\n", scene_path);
+            return EXIT_FAILURE;
+        }
+    } else {
+        hittable_list_create(&scene);
+        stock_scene(&scene);
+        bvh_build(&scene);
+    }
+
+    // Image textures are tiled into a bounded cache before rendering
+    texture_cache textures;
+    bool textures_loaded = false;
+    if (scene.texture_count > 0) {
+        if (texture_cache_create(&textures, &scene, (size_t)(texture_budget * 1e6)) == false) return EXIT_FAILURE;
+        textures_loaded = true;
+    }
+
+    // Environment light with its sampling table built once here
+    environment env;
+    if (environment_path != NULL) {
+        if (environment_load(&env, environment_path, environment_intensity) == false) {
+            fprintf(stderr, "Could not load environment %s\n", environment_path);
+            return EXIT_FAILURE;
+        }
+        env.importance = env.importance && environment_sampling;
+        scene.environment = &env;
+    }
+
+    // Previews come from the progressive renderer, which without a budget renders every sample
+    if (preview_path != NULL && budget <= 0.0) budget = RENDER_NO_BUDGET;
+
+    // Path guide trained between progressive passes, so it needs a budget
+    guide paths;
+    if (guiding && budget <= 0.0) {
+        fprintf(stderr, "Ignoring --guide, it learns between passes of a --budget render\n");
+        guiding = false;
+    }
+    if (guiding) {
+        guide_create(&paths, &scene);
+        scene.guide = &paths;
+    }
+
+    /* SETUP CAMERA */
+
+    // Image width and samples per pixel come from the options
     int max_depth = 50;
 
     // Create camera
     camera cam;
-    camera_create(&cam, &lookfrom, &lookat, &vup, defocus_angle, focus_dist, samples_per_pixel, max_depth, vfov, aspect_ratio, image_width);
+    stock_camera(&cam, image_width, samples_per_pixel, max_depth);
 
-    /* RENDER IMAGE */
+    // Load the primary hit cache if it still matches the camera and geometry
+    gbuffer cache;
+    bool cache_loaded = false;
+    if (gbuffer_path != NULL) {
+        gbuffer_create(&cache, &cam, &scene, gbuffer_samples, gbuffer_compressed);
+        FILE *cache_file = fopen(gbuffer_path, "rb");
+        if (cache_file != NULL) {
+            cache_loaded = gbuffer_load(&cache, cache_file);
+            fclose(cache_file);
+        }
+        printf("%s gbuffer %s (%.1f MB)\n", cache_loaded ? "Reusing" : "Building", gbuffer_path, gbuffer_size(&cache) / 1e6);
 
-    // Create image file
-    FILE *image = fopen("image.ppm", "wt");
-    if (image == NULL) {
-        printf("Could not create image\n");
-        return EXIT_FAILURE;
+        // A budgeted render may stop early, so it can only reuse a complete cache
+        if (budget <= 0.0 || cache_loaded) cam.gbuffer = &cache;
+    }
+
+    // Record per-pixel cost when profiling
+    render_profile profile;
+    if (profile_prefix != NULL) {
+        render_profile_create(&profile, cam.image_width, cam.image_height, &scene);
+        cam.profile = &profile;
+    }
+
+    // Start budget passes with the rows a previous profile found most expensive
+    if (cost_hint_path != NULL) {
+        FILE *hint = fopen(cost_hint_path, "rb");
+        if (hint != NULL) {
+            cam.row_order = render_profile_row_order(hint, cam.image_width, cam.image_height);
+            fclose(hint);
+        }
+        if (cam.row_order == NULL) fprintf(stderr, "Ignoring cost hint %s, it does not match the image\n", cost_hint_path);
     }
 
+    // Stream coarse images, then every finished pass, to the preview file
+    preview_file preview = {preview_path, 0.0};
+    if (preview_path != NULL) {
+        cam.preview = write_preview;
+        cam.preview_user = &preview;
+    }
+
+    /* RENDER IMAGE */
+
     // Render the scene
-    camera_render(&cam, &scene, image);
-    
-    fclose(image);
+    printf("Time to first ray: %.1f ms\n", (wall_time() - start_time) * 1000.0);
+    preview.start_time = wall_time();
+    if (stream_path != NULL) {
+        // Bands go to the file as they finish, PFM when the name says so and binary PPM otherwise
+        size_t length = strlen(stream_path);
+        band_format format = (length >= 4 && strcmp(&stream_path[length - 4], ".pfm") == 0) ? BAND_PFM : BAND_PPM;
+        FILE *stream = fopen(stream_path, "wb");
+        if (stream == NULL) {
+            fprintf(stderr, "Could not create %s\n", stream_path);
+            return EXIT_FAILURE;
+        }
+        band_writer writer;
+        if (band_writer_open(&writer, stream, format, cam.image_width, cam.image_height, band_height, queue_depth) == false) {
+            fclose(stream);
+            fprintf(stderr, "Could not write %s\n", stream_path);
+            return EXIT_FAILURE;
+        }
+        printf("Streaming %dx%d in bands of %d rows, %.1f MB of band buffers\n", cam.image_width, cam.image_height, band_height, band_writer_size(&writer) / 1e6);
+        camera_render_bands(&cam, &scene, &writer);
+        bool written = band_writer_close(&writer);
+        written = (fclose(stream) == 0) && written;
+        if (written == false) {
+            fprintf(stderr, "Could not write %s\n", stream_path);
+            return EXIT_FAILURE;
+        }
+    } else {
+        // Create image file
+        FILE *image = fopen("image.ppm", "wt");
+        if (image == NULL) {
+            printf("Could not create image\n");
+            return EXIT_FAILURE;
+        }
+
+        if (budget > 0.0) {
+            // Progressive render that stops at the wall-clock budget
+            framebuffer fb;
+            render_stats stats;
+            framebuffer_create(&fb, cam.image_width, cam.image_height);
+            camera_render_budget(&cam, &scene, &fb, budget, &stats);
+            framebuffer_write_ppm(&fb, image);
+            fflush(image);
+            framebuffer_free(&fb);
+
+            // The budget covers the written image, not just the last sample
+            render_stats_finish(&stats);
+            printf("Budget: %.3fs | Elapsed: %.3fs | Overrun: %.3fs | Passes: %d | Samples/pixel: %d-%d\n", stats.budget, stats.elapsed, stats.overrun, stats.passes, stats.min_samples, stats.max_samples);
+        } else {
+            camera_render(&cam, &scene, image);
+        }
+        fclose(image);
+    }
+
+    // Write the cost maps and the tables by primary hit
+    if (profile_prefix != NULL) {
+        if (render_profile_write(&profile, &scene, profile_prefix)) printf("Wrote profile %s_time.ppm, %s_tests.ppm, %s_paths.ppm, %s.pfm and summary tables\n", profile_prefix, profile_prefix, profile_prefix, profile_prefix);
+        else fprintf(stderr, "Could not write profile %s\n", profile_prefix);
+        render_profile_free(&profile);
+    }
+    free(cam.row_order);
+
+    // Save a freshly built cache for the next render
+    if (gbuffer_path != NULL) {
+        if (cache_loaded == false && cam.gbuffer != NULL) {
+            FILE *cache_file = fopen(gbuffer_path, "wb");
+            if (cache_file == NULL || gbuffer_save(&cache, cache_file) == false) fprintf(stderr, "Could not save gbuffer %s\n", gbuffer_path);
+            if (cache_file != NULL) fclose(cache_file);
+        }
+        gbuffer_free(&cache);
+    }
+
+    if (guiding) guide_free(&paths);
+    if (environment_path != NULL) environment_free(&env);
+    if (textures_loaded) {
+        long long hits, misses;
+        texture_cache_stats(&textures, &hits, &misses);
+        printf("Texture cache: %.1f MB | Hits: %lld | Misses: %lld\n", texture_cache_size(&textures) / 1e6, hits, misses);
+        texture_cache_free(&textures);
+    }
+    if (scene_path != NULL) scene_cache_unload(&scene);
+    else hittable_list_free(&scene);
     return EXIT_SUCCESS;
 }
@@ -1,4 +1,8 @@
+#include <string.h>
+
 #include "object.h"
+#include "texture_cache.h"
+#include "thread_pool.h"
 
 /* HIT RECORD DEFINITION */
 
@@ -29,25 +33,177 @@ double clamp(interval *i, double x) {
     return x;
 }
 
+/* AABB DEFINITION */
+
+void aabb_create(aabb *box, point3 *a, point3 *b) {
+    // Order the two corners on each axis
+    for (int axis = 0; axis < 3; axis++) {
+        box->min[axis] = fmin((*a)[axis], (*b)[axis]);
+        box->max[axis] = fmax((*a)[axis], (*b)[axis]);
+    }
+}
+
+void aabb_merge(aabb *a, aabb *b, aabb *out) {
+    for (int axis = 0; axis < 3; axis++) {
+        out->min[axis] = fmin(a->min[axis], b->min[axis]);
+        out->max[axis] = fmax(a->max[axis], b->max[axis]);
+    }
+}
+
+bool aabb_hit(aabb *box, interval *ray_t, ray *r, double *t_enter, double *t_exit) {
+    double tmin = ray_t->tmin;
+    double tmax = ray_t->tmax;
+
+    // Clip the ray interval against each pair of slabs
+    for (int axis = 0; axis < 3; axis++) {
+        double inv_d = 1.0 / r->direction[axis];
+        double t0 = (box->min[axis] - r->origin[axis]) * inv_d;
+        double t1 = (box->max[axis] - r->origin[axis]) * inv_d;
+        if (inv_d < 0.0) {
+            double temp = t0;
+            t0 = t1;
+            t1 = temp;
+        }
+        if (t0 > tmin) tmin = t0;
+        if (t1 < tmax) tmax = t1;
+        if (tmax <= tmin) return false;
+    }
+
+    *t_enter = tmin;
+    *t_exit = tmax;
+    return true;
+}
+
+/* TEXTURE DEFINITION */
+
+void create_checker_texture(texture *tex, color *even, color *odd, double scale) {
+    memset(tex, 0, sizeof(*tex));
+    tex->type = TEXTURE_CHECKER;
+    create(&tex->data.checker.even, (*even)[0], (*even)[1], (*even)[2]);
+    create(&tex->data.checker.odd, (*odd)[0], (*odd)[1], (*odd)[2]);
+    tex->data.checker.scale = scale;
+}
+
+void create_noise_texture(texture *tex, color *albedo, double scale) {
+    memset(tex, 0, sizeof(*tex));
+    tex->type = TEXTURE_NOISE;
+    create(&tex->data.noise.albedo, (*albedo)[0], (*albedo)[1], (*albedo)[2]);
+    tex->data.noise.scale = scale;
+}
+
+void create_image_texture(texture *tex, const char *path) {
+    memset(tex, 0, sizeof(*tex));
+    tex->type = TEXTURE_IMAGE;
+    if (strlen(path) >= TEXTURE_PATH_MAX) {
+        fprintf(stderr, "Texture path is too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(tex->data.image.path, path);
+}
+
+static double lattice_gradient(int x, int y, int z, double fx, double fy, double fz) {
+    // Hash the lattice point into one of the twelve cube edge gradients, no tables needed
+    uint32_t h = ((uint32_t)x * 73856093u) ^ ((uint32_t)y * 19349663u) ^ ((uint32_t)z * 83492791u);
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    switch (h % 12) {
+        case 0: return fx + fy;
+        case 1: return -fx + fy;
+        case 2: return fx - fy;
+        case 3: return -fx - fy;
+        case 4: return fx + fz;
+        case 5: return -fx + fz;
+        case 6: return fx - fz;
+        case 7: return -fx - fz;
+        case 8: return fy + fz;
+        case 9: return -fy + fz;
+        case 10: return fy - fz;
+        default: return -fy - fz;
+    }
+}
+
+static double fade(double t) {
+    return t * t * t * ((t * ((t * 6.0) - 15.0)) + 10.0);
+}
+
+double noise(point3 *p) {
+    // Gradient noise in [-1, 1] with a quintic blend between lattice points
+    double fx = floor((*p)[0]), fy = floor((*p)[1]), fz = floor((*p)[2]);
+    int x = (int)fx, y = (int)fy, z = (int)fz;
+    fx = (*p)[0] - fx;
+    fy = (*p)[1] - fy;
+    fz = (*p)[2] - fz;
+    double wx = fade(fx), wy = fade(fy), wz = fade(fz);
+
+    double result = 0.0;
+    for (int k = 0; k < 8; k++) {
+        int dx = k & 1, dy = (k >> 1) & 1, dz = (k >> 2) & 1;
+        double weight = (dx ? wx : 1.0 - wx) * (dy ? wy : 1.0 - wy) * (dz ? wz : 1.0 - wz);
+        result += weight * lattice_gradient(x + dx, y + dy, z + dz, fx - dx, fy - dy, fz - dz);
+    }
+    return result;
+}
+
+double turbulence(point3 *p, int octaves) {
+    // Sum of noise octaves, each at twice the frequency and half the weight
+    double sum = 0.0, weight = 1.0;
+    vec3 q = {(*p)[0], (*p)[1], (*p)[2]};
+    for (int k = 0; k < octaves; k++) {
+        sum += weight * fabs(noise(&q));
+        weight *= 0.5;
+        multiply(&q, 2.0, &q);
+    }
+    return sum;
+}
+
+static void checker_value(checker_data *checker, hit_record *rec, color *out) {
+    int parity = ((int)floor(rec->u * checker->scale) + (int)floor(rec->v * checker->scale)) & 1;
+    color *c = parity ? &checker->odd : &checker->even;
+
+    // Fade to the average once a footprint covers more than half a square
+    double blur = fmin(fmax((2.0 * rec->footprint * checker->scale) - 1.0, 0.0), 1.0);
+    for (int axis = 0; axis < 3; axis++) {
+        double average = 0.5 * (checker->even[axis] + checker->odd[axis]);
+        (*out)[axis] = (*c)[axis] + (blur * (average - (*c)[axis]));
+    }
+}
+
+static void noise_value(noise_data *data, hit_record *rec, color *out) {
+    // Marble veins from turbulence added to a sine along z
+    double veins = 0.5 * (1.0 + sin((data->scale * rec->p[2]) + (10.0 * turbulence(&rec->p, 7))));
+    multiply(&data->albedo, veins, out);
+}
+
 /* MATERIAL DEFINITION */
 
+// Indexed by material_type
+static bool (*scatter_functions[])(ray *, hit_record *, color *, ray *) = {
+    lambertian_scatter,
+    dielectric_scatter,
+    metal_scatter
+};
+
+bool material_scatter(ray *r, hit_record *rec, color *attenuation, ray *scattered) {
+    return scatter_functions[rec->mat->type](r, rec, attenuation, scattered);
+}
+
+static void scatter_cone(ray *r, hit_record *rec, double roughness, ray *scattered) {
+    // The cone restarts from its width at the hit and widens with rough scattering
+    scattered->width = rec->cone_width;
+    scattered->spread = r->spread + roughness;
+}
+
 /* LAMBERTIAN MATERIAL DEFINITION */
 
 void create_lambertian(material *mat, color *albedo) {
+    memset(mat, 0, sizeof(*mat));
     mat->type = LAMBERTIAN;
-    mat->data = malloc(sizeof(lambertian_data));
-    if (mat->data == NULL) {
-        fprintf(stderr, "Memory allocation failed for lambertian data\n");
-        exit(EXIT_FAILURE);
-    }
-    create(&(((lambertian_data *)mat->data)->albedo), (*albedo)[0], (*albedo)[1], (*albedo)[2]);
-    mat->scatter = lambertian_scatter;
+    mat->texture = TEXTURE_NONE;
+    create(&mat->data.lambertian.albedo, (*albedo)[0], (*albedo)[1], (*albedo)[2]);
 }
 
 bool lambertian_scatter(ray *r, hit_record *rec, color *attenuation, ray *scattered) {
-    // Uselss check to compile (r not used since random scatter direction)
-    if (r == NULL) exit(EXIT_FAILURE);
-
     // Find scatter direction
     vec3 scatter_direction, unit;
     random_unit_vector(&unit);
@@ -58,10 +214,11 @@ bool lambertian_scatter(ray *r, hit_record *rec, color *attenuation, ray *scatte
         create(&scatter_direction, rec->normal[0], rec->normal[1], rec->normal[2]);
     }
 
-    // Create scattered ray
-    create(attenuation, ((lambertian_data *)rec->mat->data)->albedo[0], ((lambertian_data *)rec->mat->data)->albedo[1], ((lambertian_data *)rec->mat->data)->albedo[2]);
+    // Create scattered ray, diffuse bounces only need a coarse texture footprint
+    create(attenuation, rec->albedo[0], rec->albedo[1], rec->albedo[2]);
     create(&scattered->origin, rec->p[0], rec->p[1], rec->p[2]);
     create(&scattered->direction, scatter_direction[0], scatter_direction[1], scatter_direction[2]);
+    scatter_cone(r, rec, 1.0, scattered);
 
     return true; // Always scatter for lambertian material
 }
@@ -69,15 +226,11 @@ bool lambertian_scatter(ray *r, hit_record *rec, color *attenuation, ray *scatte
 /* METAL MATERIAL DEFINITION */
 
 void create_metal(material *mat, color *albedo, double fuzz) {
+    memset(mat, 0, sizeof(*mat));
     mat->type = METAL;
-    mat->data = malloc(sizeof(metal_data));
-    if (mat->data == NULL) {
-        fprintf(stderr, "Memory allocation failed for metal data\n");
-        exit(EXIT_FAILURE);
-    }
-    create(&(((metal_data *)mat->data)->albedo), (*albedo)[0], (*albedo)[1], (*albedo)[2]);
-    ((metal_data *)mat->data)->fuzz = fuzz;
-    mat->scatter = metal_scatter;
+    mat->texture = TEXTURE_NONE;
+    create(&mat->data.metal.albedo, (*albedo)[0], (*albedo)[1], (*albedo)[2]);
+    mat->data.metal.fuzz = fuzz;
 }
 
 bool metal_scatter(ray *r, hit_record *rec, color *attenuation, ray *scattered) {
@@ -87,14 +240,15 @@ bool metal_scatter(ray *r, hit_record *rec, color *attenuation, ray *scattered)
 
     // Add fuzz to the reflected direction
     random_unit_vector(&unit);
-    multiply(&unit, ((metal_data *)rec->mat->data)->fuzz, &fuzzed);
+    multiply(&unit, rec->mat->data.metal.fuzz, &fuzzed);
     unit_vector(&reflected, &unit);
     add(&reflected, &fuzzed, &reflected);
 
     // Create scattered ray
-    create(attenuation, ((metal_data *)rec->mat->data)->albedo[0], ((metal_data *)rec->mat->data)->albedo[1], ((metal_data *)rec->mat->data)->albedo[2]);
+    create(attenuation, rec->albedo[0], rec->albedo[1], rec->albedo[2]);
     create(&scattered->origin, rec->p[0], rec->p[1], rec->p[2]);
     create(&scattered->direction, reflected[0], reflected[1], reflected[2]);
+    scatter_cone(r, rec, rec->mat->data.metal.fuzz, scattered);
 
     return true; // Always scatter for metal material
 }
@@ -102,14 +256,10 @@ bool metal_scatter(ray *r, hit_record *rec, color *attenuation, ray *scattered)
 /* DIELECTRIC MATERIAL DEFINITION */
 
 void create_dielectric(material *mat, double refraction_index) {
+    memset(mat, 0, sizeof(*mat));
     mat->type = DIELECTRIC;
-    mat->data = malloc(sizeof(dielectric_data));
-    if (mat->data == NULL) {
-        fprintf(stderr, "Memory allocation failed for dielectric data\n");
-        exit(EXIT_FAILURE);
-    }
-    ((dielectric_data *)mat->data)->refraction_index = refraction_index;
-    mat->scatter = dielectric_scatter;
+    mat->texture = TEXTURE_NONE;
+    mat->data.dielectric.refraction_index = refraction_index;
 }
 
 bool dielectric_scatter(ray *r, hit_record *rec, color *attenuation, ray *scattered) {
@@ -117,7 +267,7 @@ bool dielectric_scatter(ray *r, hit_record *rec, color *attenuation, ray *scatte
     create(attenuation, 1.0, 1.0, 1.0);
 
     // Calculate refraction indices
-    double ri = ((dielectric_data *)rec->mat->data)->refraction_index;
+    double ri = rec->mat->data.dielectric.refraction_index;
     if (rec->front_face == true) ri = 1.0 / ri;
 
     // Check for total internal reflection
@@ -137,6 +287,7 @@ bool dielectric_scatter(ray *r, hit_record *rec, color *attenuation, ray *scatte
 
     // Create scattered ray
     ray_create(scattered, &rec->p, &direction);
+    scatter_cone(r, rec, 0.0, scattered);
 
     return true; // Always scatter for dielectric material
 }
@@ -150,16 +301,15 @@ double reflectance(double cosine, double refraction_index) {
 
 /* SPHERE DEFINITION */
 
-void sphere_create(sphere *s, point3 *center, double radius, material *mat) {
+void sphere_create(sphere *s, point3 *center, double radius, int mat) {
     s->mat = mat;
     s->center[0] = (*center)[0];
     s->center[1] = (*center)[1];
     s->center[2] = (*center)[2];
-    if (radius < 0.0) radius = 0.0;
-    else s->radius = radius;
+    s->radius = (radius < 0.0) ? 0.0 : radius;
 }
 
-bool sphere_hit(sphere *s, interval *ray_t, ray *r, hit_record *rec) {
+bool sphere_hit(sphere *s, interval *ray_t, ray *r, double *t) {
     // Compute discriminant
     vec3 oc;
     subtract(&s->center, &r->origin, &oc);
@@ -179,82 +329,664 @@ bool sphere_hit(sphere *s, interval *ray_t, ray *r, hit_record *rec) {
         if (surrounds(ray_t, root) == false) return false;
     }
 
-    // Add hit to record
-    rec->t = root;
-    ray_at(r, rec->t, &rec->p);
+    // Only the distance is returned, attributes are deferred to the closest hit
+    *t = root;
+    return true;
+}
+
+void sphere_attributes(sphere *s, ray *r, double t, hit_record *rec) {
+    // Compute hit point and outward normal, the material is resolved by the list
+    rec->t = t;
+    ray_at(r, t, &rec->p);
+    double inv_radius = 1.0 / s->radius;
     vec3 outward_normal;
-    outward_normal[0] = (rec->p[0] - (s->center)[0]) / s->radius;
-    outward_normal[1] = (rec->p[1] - (s->center)[1]) / s->radius;
-    outward_normal[2] = (rec->p[2] - (s->center)[2]) / s->radius;
+    outward_normal[0] = (rec->p[0] - (s->center)[0]) * inv_radius;
+    outward_normal[1] = (rec->p[1] - (s->center)[1]) * inv_radius;
+    outward_normal[2] = (rec->p[2] - (s->center)[2]) * inv_radius;
     set_face_normal(r, &outward_normal, rec);
-    rec->mat = s->mat;
 
+    // Latitude and longitude, v runs from the bottom pole to the top pole
+    double theta = acos(fmin(fmax(-outward_normal[1], -1.0), 1.0));
+    double phi = atan2(-outward_normal[2], outward_normal[0]) + PI;
+    rec->u = phi / (2.0 * PI);
+    rec->v = theta / PI;
+    rec->footprint = inv_radius / PI; // Texture coordinates per world unit along v
+}
+
+void sphere_bounds(sphere *s, aabb *out) {
+    for (int axis = 0; axis < 3; axis++) {
+        out->min[axis] = s->center[axis] - s->radius;
+        out->max[axis] = s->center[axis] + s->radius;
+    }
+}
+
+/* PLANE DEFINITION */
+
+void plane_create(plane *pl, point3 *point, vec3 *normal, int mat) {
+    pl->mat = mat;
+    create(&pl->point, (*point)[0], (*point)[1], (*point)[2]);
+    unit_vector(normal, &pl->normal);
+    pl->d = dot(&pl->normal, &pl->point);
+}
+
+bool plane_hit(plane *pl, interval *ray_t, ray *r, double *t) {
+    // Ray parallel to the plane never hits it
+    double denom = dot(&pl->normal, &r->direction);
+    if (fabs(denom) < 1e-8) return false;
+
+    // Solve for the distance without any square root
+    double root = (pl->d - dot(&pl->normal, &r->origin)) / denom;
+    if (surrounds(ray_t, root) == false) return false;
+
+    *t = root;
+    return true;
+}
+
+void plane_attributes(plane *pl, ray *r, double t, hit_record *rec) {
+    rec->t = t;
+    ray_at(r, t, &rec->p);
+    set_face_normal(r, &pl->normal, rec);
+
+    // World units along two tangents, the plane has no natural extent
+    vec3 axis, tangent, bitangent, offset;
+    if (fabs(pl->normal[0]) > 0.9) create(&axis, 0.0, 1.0, 0.0);
+    else create(&axis, 1.0, 0.0, 0.0);
+    cross(&pl->normal, &axis, &tangent);
+    unit_vector(&tangent, &tangent);
+    cross(&pl->normal, &tangent, &bitangent);
+    subtract(&rec->p, &pl->point, &offset);
+    rec->u = dot(&offset, &tangent);
+    rec->v = dot(&offset, &bitangent);
+    rec->footprint = 1.0;
+}
+
+/* QUAD DEFINITION */
+
+void quad_create(quad *qd, point3 *q, vec3 *u, vec3 *v, int mat) {
+    qd->mat = mat;
+    create(&qd->q, (*q)[0], (*q)[1], (*q)[2]);
+    create(&qd->u, (*u)[0], (*u)[1], (*u)[2]);
+    create(&qd->v, (*v)[0], (*v)[1], (*v)[2]);
+
+    // Cache the plane containing the quad
+    vec3 n;
+    cross(u, v, &n);
+    unit_vector(&n, &qd->normal);
+    qd->d = dot(&qd->normal, &qd->q);
+    divide(&n, dot(&n, &n), &qd->w);
+}
+
+bool quad_hit(quad *qd, interval *ray_t, ray *r, double *t) {
+    // Intersect the plane containing the quad
+    double denom = dot(&qd->normal, &r->direction);
+    if (fabs(denom) < 1e-8) return false;
+    double root = (qd->d - dot(&qd->normal, &r->origin)) / denom;
+    if (surrounds(ray_t, root) == false) return false;
+
+    // Check the planar coordinates of the hit point
+    vec3 p, planar, temp;
+    ray_at(r, root, &p);
+    subtract(&p, &qd->q, &planar);
+    cross(&planar, &qd->v, &temp);
+    double alpha = dot(&qd->w, &temp);
+    if (alpha < 0.0 || alpha > 1.0) return false;
+    cross(&qd->u, &planar, &temp);
+    double beta = dot(&qd->w, &temp);
+    if (beta < 0.0 || beta > 1.0) return false;
+
+    *t = root;
     return true;
 }
 
+void quad_attributes(quad *qd, ray *r, double t, hit_record *rec) {
+    rec->t = t;
+    ray_at(r, t, &rec->p);
+    set_face_normal(r, &qd->normal, rec);
+
+    // Planar coordinates along the two edges
+    vec3 planar, temp;
+    subtract(&rec->p, &qd->q, &planar);
+    cross(&planar, &qd->v, &temp);
+    rec->u = dot(&qd->w, &temp);
+    cross(&qd->u, &planar, &temp);
+    rec->v = dot(&qd->w, &temp);
+    rec->footprint = 1.0 / fmin(length(&qd->u), length(&qd->v));
+}
+
+void quad_bounds(quad *qd, aabb *out) {
+    // Bound the four corners of the quad
+    point3 c1, c2, c3;
+    aabb diagonal;
+    add(&qd->q, &qd->u, &c1);
+    add(&qd->q, &qd->v, &c2);
+    add(&c1, &qd->v, &c3);
+    aabb_create(out, &qd->q, &c3);
+    aabb_create(&diagonal, &c1, &c2);
+    aabb_merge(out, &diagonal, out);
+
+    // Pad axis-aligned quads so the box never has zero thickness
+    for (int axis = 0; axis < 3; axis++) {
+        if (out->max[axis] - out->min[axis] < 1e-4) {
+            out->min[axis] -= 5e-5;
+            out->max[axis] += 5e-5;
+        }
+    }
+}
+
+/* BOX DEFINITION */
+
+void box_create(box *b, point3 *a, point3 *c, int mat) {
+    b->mat = mat;
+    aabb_create(&b->bounds, a, c);
+
+    // Pad flat boxes like quads, so every face has a center and a nonzero extent
+    for (int axis = 0; axis < 3; axis++) {
+        if (b->bounds.max[axis] - b->bounds.min[axis] < 1e-4) {
+            b->bounds.min[axis] -= 5e-5;
+            b->bounds.max[axis] += 5e-5;
+        }
+    }
+}
+
+bool box_hit(box *b, interval *ray_t, ray *r, double *t) {
+    double t_enter, t_exit;
+    if (aabb_hit(&b->bounds, ray_t, r, &t_enter, &t_exit) == false) return false;
+
+    // Use the exit distance when the ray starts inside the box
+    double root = (t_enter > ray_t->tmin) ? t_enter : t_exit;
+    if (surrounds(ray_t, root) == false) return false;
+
+    *t = root;
+    return true;
+}
+
+void box_attributes(box *b, ray *r, double t, hit_record *rec) {
+    rec->t = t;
+    ray_at(r, t, &rec->p);
+
+    // The face hit is on the axis where the point is furthest from the center
+    int face = 0;
+    double largest = 0.0, sign = 1.0;
+    for (int axis = 0; axis < 3; axis++) {
+        double half = 0.5 * (b->bounds.max[axis] - b->bounds.min[axis]);
+        double local = (rec->p[axis] - (b->bounds.min[axis] + half)) / half;
+        if (fabs(local) > largest) {
+            largest = fabs(local);
+            face = axis;
+            sign = (local < 0.0) ? -1.0 : 1.0;
+        }
+    }
+
+    vec3 outward_normal = {0.0, 0.0, 0.0};
+    outward_normal[face] = sign;
+    set_face_normal(r, &outward_normal, rec);
+
+    // Each face is mapped over its two other axes
+    int axis_u = (face + 1) % 3, axis_v = (face + 2) % 3;
+    double extent_u = b->bounds.max[axis_u] - b->bounds.min[axis_u];
+    double extent_v = b->bounds.max[axis_v] - b->bounds.min[axis_v];
+    rec->u = (rec->p[axis_u] - b->bounds.min[axis_u]) / extent_u;
+    rec->v = (rec->p[axis_v] - b->bounds.min[axis_v]) / extent_v;
+    rec->footprint = 1.0 / fmin(extent_u, extent_v);
+}
+
+void box_bounds(box *b, aabb *out) {
+    *out = b->bounds;
+}
+
 /* OBJECT LIST DEFINITION */
 
-void add_sphere(hittable_list *list, double x, double y, double z, double radius, material *mat) {
-    // Check if list is full
-    if (list->count >= 500) {
-        fprintf(stderr, "Hittable list is full\n");
+void hittable_list_create(hittable_list *list) {
+    memset(list, 0, sizeof(*list));
+    create(&list->bounds.min, INFINITY, INFINITY, INFINITY);
+    create(&list->bounds.max, -INFINITY, -INFINITY, -INFINITY);
+}
+
+void hittable_list_free(hittable_list *list) {
+    // Mapped arrays belong to the compiled scene and are released with it
+    if (list->mapping == NULL) {
+        free(list->spheres);
+        free(list->quads);
+        free(list->boxes);
+        free(list->planes);
+        free(list->materials);
+        free(list->textures);
+        free(list->nodes);
+        free(list->prims);
+    }
+    hittable_list_create(list);
+}
+
+static void *grow_array(void *array, int count, int *capacity, size_t element_size, const char *name) {
+    // Double the capacity when the array is full
+    if (count < *capacity) return array;
+    int new_capacity = (*capacity == 0) ? 64 : *capacity * 2;
+    void *grown = realloc(array, (size_t)new_capacity * element_size);
+    if (grown == NULL) {
+        fprintf(stderr, "Memory allocation failed for %s\n", name);
         exit(EXIT_FAILURE);
     }
+    *capacity = new_capacity;
+    return grown;
+}
+
+static void *reserve_array(void *array, int needed, int *capacity, size_t element_size, const char *name) {
+    // One allocation for a whole batch, at least doubling so later single adds stay cheap
+    if (needed <= *capacity) return array;
+    int new_capacity = (needed > *capacity * 2) ? needed : *capacity * 2;
+    void *grown = realloc(array, (size_t)new_capacity * element_size);
+    if (grown == NULL) {
+        fprintf(stderr, "Memory allocation failed for %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
+static void grow_bounds(hittable_list *list, uint32_t id) {
+    aabb object_box;
+    primitive_bounds(list, id, &object_box);
+    aabb_merge(&list->bounds, &object_box, &list->bounds);
+}
+
+static void check_writable(hittable_list *list) {
+    if (list->mapping != NULL) {
+        fprintf(stderr, "Cannot add objects to a compiled scene\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Any new object makes the hierarchy stale
+    list->node_count = 0;
+}
+
+int add_material(hittable_list *list, material *mat) {
+    check_writable(list);
+    list->materials = grow_array(list->materials, list->material_count, &list->material_capacity, sizeof(material), "materials");
+    list->materials[list->material_count] = *mat;
+    return list->material_count++;
+}
+
+int add_materials(hittable_list *list, int count, material *mats) {
+    // Returns the index of the first one, the rest follow in order
+    check_writable(list);
+    list->materials = reserve_array(list->materials, list->material_count + count, &list->material_capacity, sizeof(material), "materials");
+    memcpy(&list->materials[list->material_count], mats, sizeof(material) * (size_t)count);
+    int first = list->material_count;
+    list->material_count += count;
+    return first;
+}
+
+int add_texture(hittable_list *list, texture *tex) {
+    check_writable(list);
+    list->textures = grow_array(list->textures, list->texture_count, &list->texture_capacity, sizeof(texture), "textures");
+    list->textures[list->texture_count] = *tex;
+    return list->texture_count++;
+}
 
-    // Allocate memory for pointer to hittable object
-    sphere *s = malloc(sizeof(sphere));
-    if (s == NULL) {
-        fprintf(stderr, "Memory allocation failed for sphere\n");
+void add_sphere(hittable_list *list, double x, double y, double z, double radius, int mat) {
+    check_writable(list);
+    if (list->sphere_count >= PRIM_MAX_COUNT) {
+        fprintf(stderr, "Sphere list is full\n");
         exit(EXIT_FAILURE);
     }
+    list->spheres = grow_array(list->spheres, list->sphere_count, &list->sphere_capacity, sizeof(sphere), "spheres");
 
-    // Set object and hit function
     point3 center = {x, y, z};
-    sphere_create(s, &center, radius, mat);
+    sphere_create(&list->spheres[list->sphere_count], &center, radius, mat);
+    grow_bounds(list, PRIM_ID(PRIM_SPHERE, list->sphere_count));
+    list->sphere_count++;
+}
 
-    // Create hittable structure
-    hittable h = {
-        .object = s,
-        .hit = (bool (*)(void *, interval *, ray *, hit_record *))sphere_hit
-    };
+typedef struct {
+    int material_count;
+    int count;
+    sphere *out;
+    point3 *centers;
+    double *radii;
+    int32_t *mats;
+    aabb *chunk_bounds;
+    int *chunk_invalid; // First sphere of the chunk with an unknown material, -1 when none
+} sphere_batch;
+
+static void sphere_batch_job(void *context, int index) {
+    // Create one chunk of spheres and bound it
+    sphere_batch *batch = context;
+    int begin = index * INGEST_CHUNK;
+    int end = (begin + INGEST_CHUNK < batch->count) ? begin + INGEST_CHUNK : batch->count;
+    aabb *bounds = &batch->chunk_bounds[index];
+    aabb object_box;
+    create(&bounds->min, INFINITY, INFINITY, INFINITY);
+    create(&bounds->max, -INFINITY, -INFINITY, -INFINITY);
+    batch->chunk_invalid[index] = -1;
+    for (int k = begin; k < end; k++) {
+        if (batch->mats[k] < 0 || batch->mats[k] >= batch->material_count) {
+            batch->chunk_invalid[index] = k;
+            return;
+        }
+        sphere_create(&batch->out[k], &batch->centers[k], batch->radii[k], batch->mats[k]);
+        sphere_bounds(&batch->out[k], &object_box);
+        aabb_merge(bounds, &object_box, bounds);
+    }
+}
 
-    // Add hittable to list
-    list->objects[list->count] = h;
-    list->count++;
+void add_spheres(hittable_list *list, int count, point3 *centers, double *radii, int32_t *mats) {
+    check_writable(list);
+    if (count < 0) {
+        fprintf(stderr, "Invalid sphere count %d\n", count);
+        exit(EXIT_FAILURE);
+    }
+    if (count > PRIM_MAX_COUNT - list->sphere_count) {
+        fprintf(stderr, "Sphere list is full\n");
+        exit(EXIT_FAILURE);
+    }
+    if (count == 0) return;
+    list->spheres = reserve_array(list->spheres, list->sphere_count + count, &list->sphere_capacity, sizeof(sphere), "spheres");
+
+    // Chunks are created, checked and bounded on every core
+    int jobs = (count + INGEST_CHUNK - 1) / INGEST_CHUNK;
+    sphere_batch batch = {list->material_count, count, &list->spheres[list->sphere_count], centers, radii, mats, NULL, NULL};
+    batch.chunk_bounds = malloc(sizeof(aabb) * (size_t)jobs);
+    batch.chunk_invalid = malloc(sizeof(int) * (size_t)jobs);
+    if (batch.chunk_bounds == NULL || batch.chunk_invalid == NULL) {
+        fprintf(stderr, "Memory allocation failed for sphere batch\n");
+        exit(EXIT_FAILURE);
+    }
+    thread_pool pool;
+    thread_pool_create(&pool, (jobs > 1) ? cpu_count() : 1);
+    thread_pool_run(&pool, jobs, sphere_batch_job, &batch);
+    thread_pool_free(&pool);
+
+    // Merge in chunk order, the first unknown material stops the ingest
+    for (int k = 0; k < jobs; k++) {
+        int invalid = batch.chunk_invalid[k];
+        if (invalid >= 0) {
+            fprintf(stderr, "Sphere %d uses material %d, but only %d materials exist\n", invalid, mats[invalid], list->material_count);
+            exit(EXIT_FAILURE);
+        }
+        aabb_merge(&list->bounds, &batch.chunk_bounds[k], &list->bounds);
+    }
+    free(batch.chunk_bounds);
+    free(batch.chunk_invalid);
+    list->sphere_count += count;
 }
 
-bool hit(hittable_list *list, ray *r, interval *ray_t, hit_record *rec) {
-    hit_record temp_rec;
-    interval current_t;
+void add_plane(hittable_list *list, point3 *point, vec3 *normal, int mat) {
+    check_writable(list);
+    list->planes = grow_array(list->planes, list->plane_count, &list->plane_capacity, sizeof(plane), "planes");
+    plane_create(&list->planes[list->plane_count], point, normal, mat);
+    list->plane_count++;
+}
+
+void add_quad(hittable_list *list, point3 *q, vec3 *u, vec3 *v, int mat) {
+    check_writable(list);
+    if (list->quad_count >= PRIM_MAX_COUNT) {
+        fprintf(stderr, "Quad list is full\n");
+        exit(EXIT_FAILURE);
+    }
+    list->quads = grow_array(list->quads, list->quad_count, &list->quad_capacity, sizeof(quad), "quads");
+    quad_create(&list->quads[list->quad_count], q, u, v, mat);
+    grow_bounds(list, PRIM_ID(PRIM_QUAD, list->quad_count));
+    list->quad_count++;
+}
+
+void add_box(hittable_list *list, point3 *a, point3 *b, int mat) {
+    check_writable(list);
+    if (list->box_count >= PRIM_MAX_COUNT) {
+        fprintf(stderr, "Box list is full\n");
+        exit(EXIT_FAILURE);
+    }
+    list->boxes = grow_array(list->boxes, list->box_count, &list->box_capacity, sizeof(box), "boxes");
+    box_create(&list->boxes[list->box_count], a, b, mat);
+    grow_bounds(list, PRIM_ID(PRIM_BOX, list->box_count));
+    list->box_count++;
+}
+
+int primitive_count(hittable_list *list) {
+    // Bounded primitives only, planes are kept apart
+    return list->sphere_count + list->quad_count + list->box_count;
+}
+
+uint32_t primitive_id(hittable_list *list, int k) {
+    // Bounded primitives are numbered spheres first, then quads, then boxes
+    if (k < list->sphere_count) return PRIM_ID(PRIM_SPHERE, k);
+    k -= list->sphere_count;
+    if (k < list->quad_count) return PRIM_ID(PRIM_QUAD, k);
+    return PRIM_ID(PRIM_BOX, k - list->quad_count);
+}
+
+void primitive_bounds(hittable_list *list, uint32_t id, aabb *out) {
+    int index = PRIM_INDEX(id);
+    switch (PRIM_TYPE(id)) {
+        case PRIM_SPHERE: sphere_bounds(&list->spheres[index], out); break;
+        case PRIM_QUAD: quad_bounds(&list->quads[index], out); break;
+        case PRIM_BOX: box_bounds(&list->boxes[index], out); break;
+        default:
+            // Planes are unbounded
+            create(&out->min, -INFINITY, -INFINITY, -INFINITY);
+            create(&out->max, INFINITY, INFINITY, INFINITY);
+            break;
+    }
+}
+
+material *primitive_material(hittable_list *list, uint32_t id) {
+    int index = PRIM_INDEX(id);
+    switch (PRIM_TYPE(id)) {
+        case PRIM_SPHERE: return &list->materials[list->spheres[index].mat];
+        case PRIM_QUAD: return &list->materials[list->quads[index].mat];
+        case PRIM_BOX: return &list->materials[list->boxes[index].mat];
+        default: return &list->materials[list->planes[index].mat];
+    }
+}
+
+void bounding_box(hittable_list *list, aabb *out) {
+    // The root of a built hierarchy already holds the scene bounds, and owned lists keep them as they grow
+    if (list->node_count > 0) {
+        *out = list->nodes[0].bounds;
+        return;
+    }
+    if (list->mapping == NULL) {
+        *out = list->bounds;
+        return;
+    }
+
+    // Start from an empty box and grow it with every bounded primitive
+    aabb object_box;
+    create(&out->min, INFINITY, INFINITY, INFINITY);
+    create(&out->max, -INFINITY, -INFINITY, -INFINITY);
+    int count = primitive_count(list);
+    for (int k = 0; k < count; k++) {
+        primitive_bounds(list, primitive_id(list, k), &object_box);
+        aabb_merge(out, &object_box, out);
+    }
+}
+
+bool primitive_hit(hittable_list *list, uint32_t id, interval *ray_t, ray *r, double *t) {
+    int index = PRIM_INDEX(id);
+    switch (PRIM_TYPE(id)) {
+        case PRIM_SPHERE: return sphere_hit(&list->spheres[index], ray_t, r, t);
+        case PRIM_QUAD: return quad_hit(&list->quads[index], ray_t, r, t);
+        case PRIM_BOX: return box_hit(&list->boxes[index], ray_t, r, t);
+        default: return plane_hit(&list->planes[index], ray_t, r, t);
+    }
+}
+
+static bool node_hit(bvh_node *node, vec3 *inv_d, ray *r, double tmin, double tmax) {
+    // Slab test with the precomputed inverse direction
+    for (int axis = 0; axis < 3; axis++) {
+        double t0 = (node->bounds.min[axis] - r->origin[axis]) * (*inv_d)[axis];
+        double t1 = (node->bounds.max[axis] - r->origin[axis]) * (*inv_d)[axis];
+        if (t0 > t1) {
+            double temp = t0;
+            t0 = t1;
+            t1 = temp;
+        }
+        if (t0 > tmin) tmin = t0;
+        if (t1 < tmax) tmax = t1;
+        if (tmax < tmin) return false;
+    }
+    return true;
+}
+
+static bool traverse(hittable_list *list, ray *r, interval *current_t, hit_query *query, bool any, uint64_t *tests) {
     bool hit_anything = false;
-    double closest_so_far = ray_t->tmax;
+    double t;
+
+    // Linear scan when no hierarchy has been built
+    if (list->node_count == 0) {
+        int count = primitive_count(list);
+        for (int k = 0; k < count; k++) {
+            uint32_t id = primitive_id(list, k);
+            (*tests)++;
+            if (primitive_hit(list, id, current_t, r, &t) == true) {
+                if (any) return true;
+                hit_anything = true;
+                current_t->tmax = t;
+                query->id = id;
+            }
+        }
+        return hit_anything;
+    }
 
-    // Iterate through all hittables in the list
-    for (int i = 0; i < list->count; i++) {
-        hittable *obj = &list->objects[i];
+    vec3 inv_d = {1.0 / r->direction[0], 1.0 / r->direction[1], 1.0 / r->direction[2]};
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    int index = 0;
+
+    while (true) {
+        bvh_node *node = &list->nodes[index];
+        (*tests)++;
+        if (node_hit(node, &inv_d, r, current_t->tmin, current_t->tmax)) {
+            if (node->count > 0) {
+                // Leaf: test every primitive, shrinking the interval on every hit
+                for (int k = node->offset; k < node->offset + node->count; k++) {
+                    uint32_t id = list->prims[k];
+                    (*tests)++;
+                    if (primitive_hit(list, id, current_t, r, &t) == true) {
+                        if (any) return true;
+                        hit_anything = true;
+                        current_t->tmax = t;
+                        query->id = id;
+                    }
+                }
+            } else {
+                // Interior: visit the child nearer along the ray first
+                int left = index + 1;
+                int right = node->offset;
+                bvh_node *l = &list->nodes[left];
+                bvh_node *rn = &list->nodes[right];
+                double dl = 0.0, dr = 0.0;
+                for (int axis = 0; axis < 3; axis++) {
+                    dl += (l->bounds.min[axis] + l->bounds.max[axis] - 2.0 * r->origin[axis]) * r->direction[axis];
+                    dr += (rn->bounds.min[axis] + rn->bounds.max[axis] - 2.0 * r->origin[axis]) * r->direction[axis];
+                }
+                if (dl <= dr) {
+                    stack[top++] = right;
+                    index = left;
+                } else {
+                    stack[top++] = left;
+                    index = right;
+                }
+                continue;
+            }
+        }
+        if (top == 0) break;
+        index = stack[--top];
+    }
+
+    return hit_anything;
+}
 
-        // Create interval for current hittable
-        current_t.tmin = ray_t->tmin;
-        current_t.tmax = closest_so_far;
+bool closest_hit(hittable_list *list, ray *r, interval *ray_t, hit_query *query, uint64_t *tests) {
+    interval current_t = {ray_t->tmin, ray_t->tmax};
+    double t;
+    bool hit_anything = false;
+    uint64_t count = (uint64_t)list->plane_count;
 
-        // Check if hit
-        if (obj->hit(obj->object, &current_t, r, &temp_rec) == true) {
-            // Update closest hit
+    // Test cheap unbounded planes first so they tighten the interval early
+    for (int i = 0; i < list->plane_count; i++) {
+        if (plane_hit(&list->planes[i], &current_t, r, &t) == true) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-
-            // Update closest hit record
-            rec->t = temp_rec.t;
-            rec->p[0] = temp_rec.p[0];
-            rec->p[1] = temp_rec.p[1];
-            rec->p[2] = temp_rec.p[2];
-            rec->normal[0] = temp_rec.normal[0];
-            rec->normal[1] = temp_rec.normal[1];
-            rec->normal[2] = temp_rec.normal[2];
-            rec->front_face = temp_rec.front_face;
-            rec->mat = temp_rec.mat;
+            current_t.tmax = t;
+            query->id = PRIM_ID(PRIM_PLANE, i);
         }
     }
 
+    // Then walk the bounded primitives
+    if (traverse(list, r, &current_t, query, false, &count)) hit_anything = true;
+
+    query->t = current_t.tmax;
+    if (tests != NULL) *tests += count;
     return hit_anything;
 }
+
+bool any_hit(hittable_list *list, ray *r, interval *ray_t, uint64_t *tests) {
+    interval current_t = {ray_t->tmin, ray_t->tmax};
+    hit_query query;
+    double t;
+    uint64_t count = 0;
+
+    // Stop at the first plane or primitive found in the interval
+    bool found = false;
+    for (int i = 0; found == false && i < list->plane_count; i++) {
+        count++;
+        found = plane_hit(&list->planes[i], &current_t, r, &t);
+    }
+    if (found == false) found = traverse(list, r, &current_t, &query, true, &count);
+    if (tests != NULL) *tests += count;
+    return found;
+}
+
+void texture_value(hittable_list *list, int index, hit_record *rec, color *out) {
+    texture *tex = &list->textures[index];
+    switch (tex->type) {
+        case TEXTURE_CHECKER: checker_value(&tex->data.checker, rec, out); break;
+        case TEXTURE_NOISE: noise_value(&tex->data.noise, rec, out); break;
+        default:
+            // Images need a cache, without one they leave the albedo untouched
+            if (list->texture_cache != NULL) texture_cache_sample(list->texture_cache, index, rec->u, rec->v, rec->footprint, out);
+            else create(out, 1.0, 1.0, 1.0);
+            break;
+    }
+}
+
+static void material_albedo(hittable_list *list, hit_record *rec) {
+    material *mat = rec->mat;
+    switch (mat->type) {
+        case LAMBERTIAN: create(&rec->albedo, mat->data.lambertian.albedo[0], mat->data.lambertian.albedo[1], mat->data.lambertian.albedo[2]); break;
+        case METAL: create(&rec->albedo, mat->data.metal.albedo[0], mat->data.metal.albedo[1], mat->data.metal.albedo[2]); break;
+        default: create(&rec->albedo, 1.0, 1.0, 1.0); break;
+    }
+
+    // A texture tints the constant albedo
+    if (mat->texture != TEXTURE_NONE) {
+        color tex;
+        texture_value(list, mat->texture, rec, &tex);
+        for (int axis = 0; axis < 3; axis++) rec->albedo[axis] *= tex[axis];
+    }
+}
+
+void hit_attributes(hittable_list *list, ray *r, hit_query *query, hit_record *rec) {
+    int index = PRIM_INDEX(query->id);
+    switch (PRIM_TYPE(query->id)) {
+        case PRIM_SPHERE: sphere_attributes(&list->spheres[index], r, query->t, rec); break;
+        case PRIM_QUAD: quad_attributes(&list->quads[index], r, query->t, rec); break;
+        case PRIM_BOX: box_attributes(&list->boxes[index], r, query->t, rec); break;
+        default: plane_attributes(&list->planes[index], r, query->t, rec); break;
+    }
+    rec->mat = primitive_material(list, query->id);
+
+    // Primitives leave their texture scale in the footprint, widen it by the ray cone and the slant
+    double distance = query->t * length(&r->direction);
+    double slant = fabs(dot(&r->direction, &rec->normal)) / length(&r->direction);
+    rec->cone_width = r->width + (r->spread * distance);
+    rec->footprint *= rec->cone_width / fmax(slant, 0.1);
+    material_albedo(list, rec);
+}
+
+bool hit(hittable_list *list, ray *r, interval *ray_t, hit_record *rec) {
+    // Find the closest hit first and only compute its attributes once
+    hit_query query;
+    if (closest_hit(list, r, ray_t, &query, NULL) == false) return false;
+    hit_attributes(list, r, &query, rec);
+    return true;
+}
@@ -17,6 +17,12 @@ typedef struct {
     vec3 normal;
     point3 p;
     double t;
+
+    // Texture inputs, coordinates wrap outside [0, 1]
+    double u, v;
+    double footprint; // Ray cone width in texture coordinates
+    double cone_width; // Ray cone width in world units
+    color albedo; // Material color with its texture applied
 } hit_record;
 
 void set_face_normal(ray *r, vec3 *outward_normal, hit_record *rec);
@@ -33,6 +39,59 @@ bool contains(interval *i, double x);
 bool surrounds(interval *i, double x);
 double clamp(interval *i, double x);
 
+/* AABB DEFINITION */
+
+typedef struct {
+    point3 min;
+    point3 max;
+} aabb;
+
+void aabb_create(aabb *box, point3 *a, point3 *b);
+void aabb_merge(aabb *a, aabb *b, aabb *out);
+bool aabb_hit(aabb *box, interval *ray_t, ray *r, double *t_enter, double *t_exit);
+
+/* TEXTURE DEFINITION */
+
+#define TEXTURE_NONE     -1
+#define TEXTURE_PATH_MAX 256
+
+typedef enum {
+    TEXTURE_CHECKER,
+    TEXTURE_NOISE,
+    TEXTURE_IMAGE
+} texture_type;
+
+typedef struct {
+    color even;
+    color odd;
+    double scale; // Squares per unit of texture coordinates
+} checker_data;
+
+typedef struct {
+    color albedo;
+    double scale; // Noise frequency in world units
+} noise_data;
+
+typedef struct {
+    char path[TEXTURE_PATH_MAX]; // PPM or PFM file, loaded by the texture cache
+} image_data;
+
+// Plain data like materials, images are referenced by path and never by pointer
+typedef struct {
+    texture_type type;
+    union {
+        checker_data checker;
+        noise_data noise;
+        image_data image;
+    } data;
+} texture;
+
+void create_checker_texture(texture *tex, color *even, color *odd, double scale);
+void create_noise_texture(texture *tex, color *albedo, double scale);
+void create_image_texture(texture *tex, const char *path);
+double noise(point3 *p);
+double turbulence(point3 *p, int octaves);
+
 /* MATERIAL DEFINITION */
 
 typedef enum {
@@ -41,37 +100,44 @@ typedef enum {
     METAL
 } material_type;
 
+typedef struct {
+    color albedo;
+} lambertian_data;
+
+typedef struct {
+    color albedo;
+    double fuzz;
+} metal_data;
+
+typedef struct {
+    double refraction_index;
+} dielectric_data;
+
+// Plain data so material tables can be written to disk and mapped back
 typedef struct material {
     material_type type;
-    void *data;
-    bool (*scatter)(ray *r, hit_record *rec, color *attenuation, ray *scattered);
+    int32_t texture; // Albedo texture index, TEXTURE_NONE for the constant albedo
+    union {
+        lambertian_data lambertian;
+        metal_data metal;
+        dielectric_data dielectric;
+    } data;
 } material;
 
-/* LAMBERTIAN MATERIAL DEFINITION */
+bool material_scatter(ray *r, hit_record *rec, color *attenuation, ray *scattered);
 
-typedef struct {
-    color albedo;
-} lambertian_data;
+/* LAMBERTIAN MATERIAL DEFINITION */
 
 void create_lambertian(material *mat, color *albedo);
 bool lambertian_scatter(ray *r, hit_record *rec, color *attenuation, ray *scattered);
 
 /* METAL MATERIAL DEFINITION */
 
-typedef struct {
-    color albedo;
-    double fuzz;
-} metal_data;
-
 void create_metal(material *mat, color *albedo, double fuzz);
 bool metal_scatter(ray *r, hit_record *rec, color *attenuation, ray *scattered);
 
 /* DIELECTRIC MATERIAL DEFINITION */
 
-typedef struct {
-    double refraction_index;
-} dielectric_data;
-
 void create_dielectric(material *mat, double refraction_index);
 bool dielectric_scatter(ray *r, hit_record *rec, color *attenuation, ray *scattered);
 double reflectance(double cosine, double refraction_index);
@@ -79,29 +145,165 @@ double reflectance(double cosine, double refraction_index);
 /* SPHERE DEFINITION */
 
 typedef struct sphere {
-    material *mat;
     point3 center;
     double radius;
+    int32_t mat; // Index in the material table
 } sphere;
 
-void sphere_create(sphere *s, point3 *center, double radius, material *mat);
-bool sphere_hit(sphere *s, interval *ray_t, ray *r, hit_record *rec);
+void sphere_create(sphere *s, point3 *center, double radius, int mat);
+bool sphere_hit(sphere *s, interval *ray_t, ray *r, double *t);
+void sphere_attributes(sphere *s, ray *r, double t, hit_record *rec);
+void sphere_bounds(sphere *s, aabb *out);
+
+/* PLANE DEFINITION */
+
+typedef struct {
+    point3 point;
+    vec3 normal;
+    double d; // Plane offset, dot(normal, point)
+    int32_t mat;
+} plane;
+
+void plane_create(plane *pl, point3 *point, vec3 *normal, int mat);
+bool plane_hit(plane *pl, interval *ray_t, ray *r, double *t);
+void plane_attributes(plane *pl, ray *r, double t, hit_record *rec);
+
+/* QUAD DEFINITION */
+
+typedef struct {
+    point3 q;
+    vec3 u, v;
+    vec3 normal;
+    vec3 w; // Cached n / dot(n, n) for the planar coordinates
+    double d;
+    int32_t mat;
+} quad;
+
+void quad_create(quad *qd, point3 *q, vec3 *u, vec3 *v, int mat);
+bool quad_hit(quad *qd, interval *ray_t, ray *r, double *t);
+void quad_attributes(quad *qd, ray *r, double t, hit_record *rec);
+void quad_bounds(quad *qd, aabb *out);
+
+/* BOX DEFINITION */
+
+typedef struct {
+    aabb bounds;
+    int32_t mat;
+} box;
+
+void box_create(box *b, point3 *a, point3 *c, int mat);
+bool box_hit(box *b, interval *ray_t, ray *r, double *t);
+void box_attributes(box *b, ray *r, double t, hit_record *rec);
+void box_bounds(box *b, aabb *out);
 
-/* OBJECT DEFINITION */
+/* PRIMITIVE ID DEFINITION */
+
+// Primitive ids keep the primitive type in the top bits and the array index below
+typedef enum {
+    PRIM_SPHERE,
+    PRIM_QUAD,
+    PRIM_BOX,
+    PRIM_PLANE
+} primitive_type;
+
+#define PRIM_ID(type, index) ((uint32_t)(((uint32_t)(type) << 28) | (uint32_t)(index)))
+#define PRIM_TYPE(id)        ((primitive_type)((uint32_t)(id) >> 28))
+#define PRIM_INDEX(id)       ((int)((uint32_t)(id) & 0x0FFFFFFFu))
+#define PRIM_MAX_COUNT       0x0FFFFFFF
+
+/* HIT QUERY DEFINITION */
+
+typedef struct {
+    uint32_t id; // Primitive id of the closest hit
+    double t;
+} hit_query;
+
+/* BVH NODE DEFINITION */
 
 typedef struct {
-    void *object;
-    bool (*hit)(void *object, interval *i, ray *r, hit_record *rec);
-} hittable;
+    aabb bounds;
+    int32_t offset; // First primitive for leaves, right child for interior nodes
+    int32_t count; // Primitive count for leaves, zero for interior nodes
+} bvh_node;
+
+#define BVH_STACK_SIZE 64 // Pending nodes during traversal, bounds the depth of a usable hierarchy
 
 /* OBJECT LIST DEFINITION */
 
+struct texture_cache; // Forward declaration
+struct environment; // Forward declaration
+struct guide; // Forward declaration
+
+// Flat arrays with indices only, either owned or mapped read-only from a compiled scene
 typedef struct {
-    hittable objects[500];
-    int count;
+    sphere *spheres;
+    int sphere_count;
+    quad *quads;
+    int quad_count;
+    box *boxes;
+    int box_count;
+
+    // Unbounded objects stay out of the hierarchy and are tested first
+    plane *planes;
+    int plane_count;
+
+    material *materials;
+    int material_count;
+    texture *textures;
+    int texture_count;
+
+    // Hierarchy over the bounded primitives, empty until bvh_build is called
+    bvh_node *nodes;
+    int node_count;
+    uint32_t *prims; // Primitive ids in leaf order
+
+    // Union of the bounded primitives added so far, only kept for owned arrays
+    aabb bounds;
+
+    // Allocated sizes of the owned arrays
+    int sphere_capacity;
+    int quad_capacity;
+    int box_capacity;
+    int plane_capacity;
+    int material_capacity;
+    int texture_capacity;
+
+    // Mapping that backs the arrays of a loaded compiled scene, NULL when owned
+    void *mapping;
+    size_t mapping_size;
+
+    // Image tiles shared by every thread, attached at runtime and never stored
+    struct texture_cache *texture_cache;
+
+    // Environment light attached at runtime, NULL for the sky gradient
+    struct environment *environment;
+
+    // Learned sampling distributions attached at runtime, NULL when unguided
+    struct guide *guide;
 } hittable_list;
 
-void add_sphere(hittable_list *list, double x, double y, double z, double radius, material *mat);
+void hittable_list_create(hittable_list *list);
+void hittable_list_free(hittable_list *list);
+int add_material(hittable_list *list, material *mat);
+int add_materials(hittable_list *list, int count, material *mats);
+int add_texture(hittable_list *list, texture *tex);
+void add_sphere(hittable_list *list, double x, double y, double z, double radius, int mat);
+#define INGEST_CHUNK 16384 // Spheres per job when a batch is ingested on every core
+
+void add_spheres(hittable_list *list, int count, point3 *centers, double *radii, int32_t *mats);
+void add_plane(hittable_list *list, point3 *point, vec3 *normal, int mat);
+void add_quad(hittable_list *list, point3 *q, vec3 *u, vec3 *v, int mat);
+void add_box(hittable_list *list, point3 *a, point3 *b, int mat);
+int primitive_count(hittable_list *list);
+uint32_t primitive_id(hittable_list *list, int k);
+void primitive_bounds(hittable_list *list, uint32_t id, aabb *out);
+material *primitive_material(hittable_list *list, uint32_t id);
+void bounding_box(hittable_list *list, aabb *out);
+bool primitive_hit(hittable_list *list, uint32_t id, interval *ray_t, ray *r, double *t);
+bool closest_hit(hittable_list *list, ray *r, interval *ray_t, hit_query *query, uint64_t *tests);
+bool any_hit(hittable_list *list, ray *r, interval *ray_t, uint64_t *tests);
+void texture_value(hittable_list *list, int index, hit_record *rec, color *out);
+void hit_attributes(hittable_list *list, ray *r, hit_query *query, hit_record *rec);
 bool hit(hittable_list *list, ray *r, interval *ray_t, hit_record *rec);
 
 #endif
@@ -0,0 +1,275 @@
+#include <string.h>
+
+#include "framebuffer.h"
+#include "profile.h"
+
+/* RENDER PROFILE DEFINITION */
+
+static void *profile_alloc(size_t count, size_t size) {
+    void *data = calloc(count, size);
+    if (data == NULL) {
+        fprintf(stderr, "Memory allocation failed for render profile\n");
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+static int slot_count(render_profile *profile) {
+    return profile->sphere_count + profile->quad_count + profile->box_count + profile->plane_count + 1;
+}
+
+static int slot_of(render_profile *profile, uint32_t primary) {
+    if (primary == PROFILE_MISS) return slot_count(profile) - 1;
+    int index = PRIM_INDEX(primary);
+    switch (PRIM_TYPE(primary)) {
+        case PRIM_SPHERE: return index;
+        case PRIM_QUAD: return profile->sphere_count + index;
+        case PRIM_BOX: return profile->sphere_count + profile->quad_count + index;
+        default: return profile->sphere_count + profile->quad_count + profile->box_count + index;
+    }
+}
+
+static uint32_t slot_id(render_profile *profile, int slot) {
+    // Inverse of slot_of
+    if (slot < profile->sphere_count) return PRIM_ID(PRIM_SPHERE, slot);
+    slot -= profile->sphere_count;
+    if (slot < profile->quad_count) return PRIM_ID(PRIM_QUAD, slot);
+    slot -= profile->quad_count;
+    if (slot < profile->box_count) return PRIM_ID(PRIM_BOX, slot);
+    slot -= profile->box_count;
+    if (slot < profile->plane_count) return PRIM_ID(PRIM_PLANE, slot);
+    return PROFILE_MISS;
+}
+
+void render_profile_create(render_profile *profile, int width, int height, hittable_list *list) {
+    size_t pixels = (size_t)width * (size_t)height;
+    profile->width = width;
+    profile->height = height;
+    profile->nanoseconds = profile_alloc(pixels, sizeof(double));
+    profile->tests = profile_alloc(pixels, sizeof(double));
+    profile->segments = profile_alloc(pixels, sizeof(double));
+    profile->samples = profile_alloc(pixels, sizeof(int));
+    profile->sphere_count = list->sphere_count;
+    profile->quad_count = list->quad_count;
+    profile->box_count = list->box_count;
+    profile->plane_count = list->plane_count;
+    profile->totals = profile_alloc((size_t)slot_count(profile), sizeof(profile_totals));
+}
+
+void render_profile_free(render_profile *profile) {
+    free(profile->nanoseconds);
+    free(profile->tests);
+    free(profile->segments);
+    free(profile->samples);
+    free(profile->totals);
+    memset(profile, 0, sizeof(*profile));
+}
+
+void render_profile_add(render_profile *profile, int i, int j, uint32_t primary, double nanoseconds, double tests, double segments) {
+    size_t index = ((size_t)j * (size_t)profile->width) + (size_t)i;
+    profile->nanoseconds[index] += nanoseconds;
+    profile->tests[index] += tests;
+    profile->segments[index] += segments;
+    profile->samples[index]++;
+
+    profile_totals *totals = &profile->totals[slot_of(profile, primary)];
+    totals->samples++;
+    totals->nanoseconds += nanoseconds;
+    totals->tests += tests;
+    totals->segments += segments;
+}
+
+static double path_length(render_profile *profile, size_t index) {
+    return (profile->samples[index] > 0) ? profile->segments[index] / profile->samples[index] : 0.0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void false_color(double t, int *rgb) {
+    // Dark blue through cyan, green and yellow to red
+    static const double ramp[5][3] = {{0.0, 0.0, 0.3}, {0.0, 0.6, 1.0}, {0.0, 0.9, 0.2}, {1.0, 0.9, 0.0}, {1.0, 0.0, 0.0}};
+    t = fmin(fmax(t, 0.0), 1.0) * 4.0;
+    int k = (t >= 4.0) ? 3 : (int)t;
+    double f = t - k;
+    for (int c = 0; c < 3; c++) rgb[c] = (int)(255.999 * (ramp[k][c] + (f * (ramp[k + 1][c] - ramp[k][c]))));
+}
+
+static bool write_heatmap(render_profile *profile, int channel, const char *path) {
+    size_t pixels = (size_t)profile->width * (size_t)profile->height;
+    double *values = profile_alloc(pixels, sizeof(double));
+    double *sorted = profile_alloc(pixels, sizeof(double));
+    for (size_t k = 0; k < pixels; k++) {
+        if (channel == 0) values[k] = profile->nanoseconds[k];
+        else if (channel == 1) values[k] = profile->tests[k];
+        else values[k] = path_length(profile, k);
+        sorted[k] = values[k];
+    }
+
+    // Scale to the 99th percentile so a few outliers do not flatten the map
+    qsort(sorted, pixels, sizeof(double), compare_double);
+    double scale = sorted[(pixels * 99) / 100];
+    if (scale <= 0.0) scale = sorted[pixels - 1];
+    if (scale <= 0.0) scale = 1.0;
+    free(sorted);
+
+    FILE *image = fopen(path, "w");
+    if (image == NULL) {
+        free(values);
+        return false;
+    }
+    fprintf(image, "P3\n%d %d\n255\n", profile->width, profile->height);
+    int rgb[3];
+    for (size_t k = 0; k < pixels; k++) {
+        false_color(values[k] / scale, rgb);
+        fprintf(image, "%d %d %d\n", rgb[0], rgb[1], rgb[2]);
+    }
+    free(values);
+    return fclose(image) == 0;
+}
+
+static bool write_raw(render_profile *profile, const char *path) {
+    // Nanoseconds, intersection tests and mean path length as the three PFM channels
+    framebuffer fb;
+    framebuffer_create(&fb, profile->width, profile->height);
+    for (int j = 0; j < profile->height; j++) {
+        for (int i = 0; i < profile->width; i++) {
+            size_t index = ((size_t)j * (size_t)profile->width) + (size_t)i;
+            color c = {profile->nanoseconds[index], profile->tests[index], path_length(profile, index)};
+            framebuffer_add(&fb, i, j, &c);
+        }
+    }
+    FILE *file = fopen(path, "wb");
+    bool written = file != NULL;
+    if (written) {
+        framebuffer_write_pfm(&fb, file);
+        written = fclose(file) == 0;
+    }
+    framebuffer_free(&fb);
+    return written;
+}
+
+static const char *primitive_name(uint32_t id) {
+    if (id == PROFILE_MISS) return "miss";
+    switch (PRIM_TYPE(id)) {
+        case PRIM_SPHERE: return "sphere";
+        case PRIM_QUAD: return "quad";
+        case PRIM_BOX: return "box";
+        default: return "plane";
+    }
+}
+
+static const char *material_name(material_type type) {
+    switch (type) {
+        case LAMBERTIAN: return "lambertian";
+        case DIELECTRIC: return "dielectric";
+        default: return "metal";
+    }
+}
+
+static bool write_summary(render_profile *profile, hittable_list *list, const char *primitives_path, const char *materials_path) {
+    double total_time = 0.0;
+    int slots = slot_count(profile);
+    for (int k = 0; k < slots; k++) total_time += profile->totals[k].nanoseconds;
+    if (total_time <= 0.0) total_time = 1.0;
+
+    // One row per primitive a primary ray hit, and the materials they add up to
+    profile_totals *by_material = profile_alloc((size_t)list->material_count + 1, sizeof(profile_totals));
+    FILE *file = fopen(primitives_path, "w");
+    if (file == NULL) {
+        free(by_material);
+        return false;
+    }
+    fprintf(file, "type,index,material,samples,time_ms,time_share,tests_per_sample,path_length\n");
+    for (int k = 0; k < slots; k++) {
+        profile_totals *t = &profile->totals[k];
+        if (t->samples == 0) continue;
+        uint32_t id = slot_id(profile, k);
+        int mat = (id == PROFILE_MISS) ? -1 : (int)(primitive_material(list, id) - list->materials);
+        fprintf(file, "%s,%d,%d,%lld,%.3f,%.4f,%.1f,%.2f\n", primitive_name(id), (id == PROFILE_MISS) ? -1 : PRIM_INDEX(id), mat, t->samples, t->nanoseconds * 1e-6, t->nanoseconds / total_time, t->tests / t->samples, t->segments / t->samples);
+
+        profile_totals *m = &by_material[(mat < 0) ? list->material_count : mat];
+        m->samples += t->samples;
+        m->nanoseconds += t->nanoseconds;
+        m->tests += t->tests;
+        m->segments += t->segments;
+    }
+    bool written = fclose(file) == 0;
+
+    file = fopen(materials_path, "w");
+    if (file == NULL) {
+        free(by_material);
+        return false;
+    }
+    fprintf(file, "material,type,samples,time_ms,time_share,tests_per_sample,path_length\n");
+    for (int k = 0; k <= list->material_count; k++) {
+        profile_totals *m = &by_material[k];
+        if (m->samples == 0) continue;
+        const char *name = (k == list->material_count) ? "background" : material_name(list->materials[k].type);
+        fprintf(file, "%d,%s,%lld,%.3f,%.4f,%.1f,%.2f\n", (k == list->material_count) ? -1 : k, name, m->samples, m->nanoseconds * 1e-6, m->nanoseconds / total_time, m->tests / m->samples, m->segments / m->samples);
+    }
+    written = (fclose(file) == 0) && written;
+    free(by_material);
+    return written;
+}
+
+bool render_profile_write(render_profile *profile, hittable_list *list, const char *prefix) {
+    // prefix_time.ppm, prefix_tests.ppm, prefix_paths.ppm, prefix.pfm and two summary tables
+    size_t length = strlen(prefix) + 32;
+    char *path = profile_alloc(length, 1);
+    char *second = profile_alloc(length, 1);
+    bool written = true;
+
+    snprintf(path, length, "%s_time.ppm", prefix);
+    written = write_heatmap(profile, 0, path) && written;
+    snprintf(path, length, "%s_tests.ppm", prefix);
+    written = write_heatmap(profile, 1, path) && written;
+    snprintf(path, length, "%s_paths.ppm", prefix);
+    written = write_heatmap(profile, 2, path) && written;
+    snprintf(path, length, "%s.pfm", prefix);
+    written = write_raw(profile, path) && written;
+    snprintf(path, length, "%s_primitives.csv", prefix);
+    snprintf(second, length, "%s_materials.csv", prefix);
+    written = write_summary(profile, list, path, second) && written;
+
+    free(path);
+    free(second);
+    return written;
+}
+
+static const double *row_costs; // Sort key for the comparator below
+
+static int compare_rows(const void *a, const void *b) {
+    // Most expensive first, ties keep the top to bottom order
+    double x = row_costs[*(const int *)a];
+    double y = row_costs[*(const int *)b];
+    if (x != y) return (x < y) - (x > y);
+    return *(const int *)a - *(const int *)b;
+}
+
+int *render_profile_row_order(FILE *raw, int width, int height) {
+    // Rows of a previous profile sorted by their measured time, NULL if it does not match
+    framebuffer fb;
+    if (framebuffer_read_pfm(&fb, raw) == false) return NULL;
+    if (fb.width != width || fb.height != height) {
+        framebuffer_free(&fb);
+        return NULL;
+    }
+
+    double *costs = profile_alloc((size_t)height, sizeof(double));
+    int *order = profile_alloc((size_t)height, sizeof(int));
+    for (int j = 0; j < height; j++) {
+        order[j] = j;
+        for (int i = 0; i < width; i++) costs[j] += fb.pixels[(((size_t)j * width) + i) * 3];
+    }
+    row_costs = costs;
+    qsort(order, (size_t)height, sizeof(int), compare_rows);
+    row_costs = NULL;
+
+    free(costs);
+    framebuffer_free(&fb);
+    return order;
+}
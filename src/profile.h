@@ -0,0 +1,40 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "object.h"
+
+/* RENDER PROFILE DEFINITION */
+
+#define PROFILE_MISS UINT32_MAX // Primary ray escaped to the background
+
+typedef struct {
+    long long samples;
+    double nanoseconds;
+    double tests;
+    double segments;
+} profile_totals;
+
+// Per-pixel cost of a render, plus totals by the primitive each primary ray hit
+typedef struct render_profile {
+    int width;
+    int height;
+    double *nanoseconds; // Wall-clock time summed over the pixel's samples
+    double *tests; // Ray-box and ray-primitive tests
+    double *segments; // Path segments traced
+    int *samples;
+
+    // Primitives in id order, spheres, quads, boxes, planes, then one slot for misses
+    int sphere_count;
+    int quad_count;
+    int box_count;
+    int plane_count;
+    profile_totals *totals;
+} render_profile;
+
+void render_profile_create(render_profile *profile, int width, int height, hittable_list *list);
+void render_profile_free(render_profile *profile);
+void render_profile_add(render_profile *profile, int i, int j, uint32_t primary, double nanoseconds, double tests, double segments);
+bool render_profile_write(render_profile *profile, hittable_list *list, const char *prefix);
+int *render_profile_row_order(FILE *raw, int width, int height);
+
+#endif
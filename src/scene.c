@@ -0,0 +1,163 @@
+#include "scene.h"
+
+/* SCENE DEFINITION */
+
+static void random_sphere(double x, double z, point3 *center, material *mat) {
+    // Randomly choose material and position
+    double choose_material = RAND_DOUBLE;
+    create(center, x + (0.9 * RAND_DOUBLE), 0.2, z + (0.9 * RAND_DOUBLE));
+
+    // Create sphere based on material choice
+    if (choose_material < 0.8) {
+        // Create lambertian sphere
+        color albedo;
+        create(&albedo, RAND_DOUBLE * RAND_DOUBLE, RAND_DOUBLE * RAND_DOUBLE, RAND_DOUBLE * RAND_DOUBLE);
+        create_lambertian(mat, &albedo);
+    } else if (choose_material < 0.95) {
+        // Create metal sphere
+        color albedo;
+        create(&albedo, 0.5 * (1 + RAND_DOUBLE), 0.5 * (1 + RAND_DOUBLE), 0.5 * (1 + RAND_DOUBLE));
+        double fuzz = 0.5 * RAND_DOUBLE;
+        create_metal(mat, &albedo, fuzz);
+    } else {
+        // Create dielectric sphere
+        create_dielectric(mat, 1.5);
+    }
+}
+
+static void add_random_sphere(hittable_list *list, double x, double z) {
+    point3 center;
+    material mat;
+    random_sphere(x, z, &center, &mat);
+    add_sphere(list, center[0], center[1], center[2], 0.2, add_material(list, &mat));
+}
+
+static void add_feature_spheres(hittable_list *list) {
+    // Add a large dielectric sphere
+    material material1;
+    create_dielectric(&material1, 1.5);
+    add_sphere(list, 0.0, 1.0, 0.0, 1.0, add_material(list, &material1));
+
+    // Add a large lambertian sphere
+    material material2;
+    color albedo2;
+    create(&albedo2, 0.4, 0.2, 0.1);
+    create_lambertian(&material2, &albedo2);
+    add_sphere(list, -4.0, 1.0, 0.0, 1.0, add_material(list, &material2));
+
+    // Add a large metal sphere
+    material material3;
+    color albedo3;
+    create(&albedo3, 0.7, 0.6, 0.5);
+    create_metal(&material3, &albedo3, 0.0);
+    add_sphere(list, 4.0, 1.0, 0.0, 1.0, add_material(list, &material3));
+}
+
+static void add_ground(hittable_list *list) {
+    // Create ground plane
+    material ground_material;
+    color ground_color = {0.5, 0.5, 0.5};
+    create_lambertian(&ground_material, &ground_color);
+    point3 ground_point = {0.0, 0.0, 0.0};
+    vec3 ground_normal = {0.0, 1.0, 0.0};
+    add_plane(list, &ground_point, &ground_normal, add_material(list, &ground_material));
+}
+
+void stock_scene(hittable_list *list) {
+    add_ground(list);
+
+    // Create random spheres
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            add_random_sphere(list, a, b);
+        }
+    }
+
+    add_feature_spheres(list);
+}
+
+void random_scene(hittable_list *list, int count) {
+    add_ground(list);
+
+    // Same sphere density as the stock scene on a square grid around the origin
+    int side = (int)ceil(sqrt((double)count));
+    int half = side / 2;
+    point3 *centers = malloc(sizeof(point3) * (size_t)count);
+    double *radii = malloc(sizeof(double) * (size_t)count);
+    int32_t *mats = malloc(sizeof(int32_t) * (size_t)count);
+    material *materials = malloc(sizeof(material) * (size_t)count);
+    if (centers == NULL || radii == NULL || mats == NULL || materials == NULL) {
+        fprintf(stderr, "Memory allocation failed for random scene\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < count; k++) {
+        random_sphere((k % side) - half, (k / side) - half, &centers[k], &materials[k]);
+        radii[k] = 0.2;
+    }
+
+    // Ingest the whole field at once, every sphere has its own material
+    int first = add_materials(list, count, materials);
+    for (int k = 0; k < count; k++) mats[k] = first + k;
+    add_spheres(list, count, centers, radii, mats);
+    free(centers);
+    free(radii);
+    free(mats);
+    free(materials);
+
+    add_feature_spheres(list);
+}
+
+void texture_scene(hittable_list *list, const char *image_path) {
+    // Checkered ground plane with one unit squares
+    texture checker;
+    color even = {0.2, 0.3, 0.1}, odd = {0.9, 0.9, 0.9}, white = {1.0, 1.0, 1.0};
+    create_checker_texture(&checker, &even, &odd, 1.0);
+    material ground_material;
+    create_lambertian(&ground_material, &white);
+    ground_material.texture = add_texture(list, &checker);
+    point3 ground_point = {0.0, 0.0, 0.0};
+    vec3 ground_normal = {0.0, 1.0, 0.0};
+    add_plane(list, &ground_point, &ground_normal, add_material(list, &ground_material));
+
+    // Marble sphere from procedural noise
+    texture marble;
+    create_noise_texture(&marble, &white, 4.0);
+    material marble_material;
+    create_lambertian(&marble_material, &white);
+    marble_material.texture = add_texture(list, &marble);
+    add_sphere(list, -4.0, 1.0, 0.0, 1.0, add_material(list, &marble_material));
+
+    // Image mapped sphere, or a checkered one when no image is given
+    texture surface;
+    if (image_path != NULL) create_image_texture(&surface, image_path);
+    else create_checker_texture(&surface, &even, &odd, 16.0);
+    material surface_material;
+    create_lambertian(&surface_material, &white);
+    surface_material.texture = add_texture(list, &surface);
+    add_sphere(list, 0.0, 1.0, 0.0, 1.0, add_material(list, &surface_material));
+
+    // Brushed metal tinted by the same marble
+    material metal_material;
+    color tint = {0.8, 0.7, 0.6};
+    create_metal(&metal_material, &tint, 0.1);
+    metal_material.texture = marble_material.texture;
+    add_sphere(list, 4.0, 1.0, 0.0, 1.0, add_material(list, &metal_material));
+}
+
+void stock_camera(camera *cam, int image_width, int samples_per_pixel, int max_depth) {
+    // Set camera position
+    double vfov = 20.0;
+    vec3 lookfrom, lookat, vup;
+    create(&lookfrom, 13.0, 2.0, 3.0);
+    create(&lookat, 0.0, 0.0, 0.0);
+    create(&vup, 0.0, 1.0, 0.0);
+
+    // Set camera parameters
+    double aspect_ratio = 16.0 / 9.0;
+
+    // Defocus blur parameters
+    double defocus_angle = 0.6;
+    double focus_dist = 10.0;
+
+    camera_create(cam, &lookfrom, &lookat, &vup, defocus_angle, focus_dist, samples_per_pixel, max_depth, vfov, aspect_ratio, image_width);
+}
@@ -0,0 +1,13 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "camera.h"
+
+/* SCENE DEFINITION */
+
+void stock_scene(hittable_list *list);
+void random_scene(hittable_list *list, int count);
+void texture_scene(hittable_list *list, const char *image_path);
+void stock_camera(camera *cam, int image_width, int samples_per_pixel, int max_depth);
+
+#endif
@@ -0,0 +1,259 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scene_cache.h"
+
+/* SCENE CACHE DEFINITION */
+
+static const uint32_t element_sizes[SECTION_COUNT] = {
+    sizeof(sphere),
+    sizeof(quad),
+    sizeof(box),
+    sizeof(plane),
+    sizeof(material),
+    sizeof(texture),
+    sizeof(bvh_node),
+    sizeof(uint32_t)
+};
+
+static uint64_t checksum(uint64_t hash, const unsigned char *data, size_t size) {
+    // Word-at-a-time mix, callers pass whole words
+    for (size_t k = 0; k + 8 <= size; k += 8) {
+        uint64_t word;
+        memcpy(&word, data + k, sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+static uint64_t aligned(uint64_t offset) {
+    return (offset + SCENE_CACHE_ALIGNMENT - 1) & ~(uint64_t)(SCENE_CACHE_ALIGNMENT - 1);
+}
+
+static uint64_t checksum_padded(uint64_t hash, const unsigned char *data, size_t size, size_t padded_size) {
+    // Same result as checksum() over the data followed by zero padding
+    size_t full = size & ~(size_t)7;
+    hash = checksum(hash, data, full);
+    unsigned char tail[8] = {0};
+    if (size > full) {
+        memcpy(tail, data + full, size - full);
+        hash = checksum(hash, tail, sizeof(tail));
+        full += 8;
+    }
+    memset(tail, 0, sizeof(tail));
+    for (; full < padded_size; full += 8) hash = checksum(hash, tail, sizeof(tail));
+    return hash;
+}
+
+bool scene_cache_save(hittable_list *list, const char *path) {
+    const void *arrays[SECTION_COUNT] = {list->spheres, list->quads, list->boxes, list->planes, list->materials, list->textures, list->nodes, list->prims};
+    uint64_t counts[SECTION_COUNT] = {
+        (uint64_t)list->sphere_count,
+        (uint64_t)list->quad_count,
+        (uint64_t)list->box_count,
+        (uint64_t)list->plane_count,
+        (uint64_t)list->material_count,
+        (uint64_t)list->texture_count,
+        (uint64_t)list->node_count,
+        (list->node_count > 0) ? (uint64_t)primitive_count(list) : 0
+    };
+
+    // Lay the sections out one after another, each aligned for direct use
+    scene_cache_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SCENE_CACHE_MAGIC;
+    header.version = SCENE_CACHE_VERSION;
+    header.endian = SCENE_CACHE_ENDIAN;
+    uint64_t offset = aligned(sizeof(header));
+    for (int k = 0; k < SECTION_COUNT; k++) {
+        header.element_sizes[k] = element_sizes[k];
+        header.sections[k].offset = offset;
+        header.sections[k].count = counts[k];
+        offset = aligned(offset + (counts[k] * element_sizes[k]));
+    }
+    header.file_size = offset;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return false;
+
+    // Reserve the header, then stream every section with its zero padding
+    static const unsigned char zeros[SCENE_CACHE_ALIGNMENT] = {0};
+    bool written = fwrite(zeros, (size_t)aligned(sizeof(header)), 1, file) == 1;
+    for (int k = 0; written && k < SECTION_COUNT; k++) {
+        size_t bytes = (size_t)(counts[k] * element_sizes[k]);
+        size_t padded = (size_t)(aligned(header.sections[k].offset + bytes) - header.sections[k].offset);
+        if (bytes > 0) written = fwrite(arrays[k], bytes, 1, file) == 1;
+        if (written && padded > bytes) written = fwrite(zeros, padded - bytes, 1, file) == 1;
+        header.data_checksum = checksum_padded(header.data_checksum, arrays[k], bytes, padded);
+    }
+
+    // Write the finished header last
+    header.header_checksum = checksum(0, (unsigned char *)&header, offsetof(scene_cache_header, header_checksum));
+    written = written && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    written = (fclose(file) == 0) && written;
+    return written;
+}
+
+static bool valid_material_index(int32_t mat, uint64_t material_count) {
+    return mat >= 0 && (uint64_t)mat < material_count;
+}
+
+static bool valid_tables(unsigned char *base, scene_cache_header *header) {
+    // Every index the renderer follows without checking has to land inside its table
+    scene_section *sections = header->sections;
+    uint64_t material_count = sections[SECTION_MATERIALS].count;
+    uint64_t texture_count = sections[SECTION_TEXTURES].count;
+
+    sphere *spheres = (sphere *)(base + sections[SECTION_SPHERES].offset);
+    for (uint64_t k = 0; k < sections[SECTION_SPHERES].count; k++) {
+        if (valid_material_index(spheres[k].mat, material_count) == false) return false;
+    }
+    quad *quads = (quad *)(base + sections[SECTION_QUADS].offset);
+    for (uint64_t k = 0; k < sections[SECTION_QUADS].count; k++) {
+        if (valid_material_index(quads[k].mat, material_count) == false) return false;
+    }
+    box *boxes = (box *)(base + sections[SECTION_BOXES].offset);
+    for (uint64_t k = 0; k < sections[SECTION_BOXES].count; k++) {
+        if (valid_material_index(boxes[k].mat, material_count) == false) return false;
+    }
+    plane *planes = (plane *)(base + sections[SECTION_PLANES].offset);
+    for (uint64_t k = 0; k < sections[SECTION_PLANES].count; k++) {
+        if (valid_material_index(planes[k].mat, material_count) == false) return false;
+    }
+
+    material *materials = (material *)(base + sections[SECTION_MATERIALS].offset);
+    for (uint64_t k = 0; k < material_count; k++) {
+        if ((unsigned)materials[k].type > METAL) return false;
+        int32_t tex = materials[k].texture;
+        if (tex != TEXTURE_NONE && (tex < 0 || (uint64_t)tex >= texture_count)) return false;
+    }
+
+    // Image paths are used as strings, so they must be terminated inside the record
+    texture *textures = (texture *)(base + sections[SECTION_TEXTURES].offset);
+    for (uint64_t k = 0; k < texture_count; k++) {
+        if ((unsigned)textures[k].type > TEXTURE_IMAGE) return false;
+        if (textures[k].type == TEXTURE_IMAGE && memchr(textures[k].data.image.path, '\0', TEXTURE_PATH_MAX) == NULL) return false;
+    }
+
+    uint32_t *prims = (uint32_t *)(base + sections[SECTION_PRIMS].offset);
+    uint64_t prim_count = sections[SECTION_PRIMS].count;
+    for (uint64_t k = 0; k < prim_count; k++) {
+        primitive_type type = PRIM_TYPE(prims[k]);
+        uint64_t index = (uint64_t)PRIM_INDEX(prims[k]);
+        if (type == PRIM_SPHERE && index < sections[SECTION_SPHERES].count) continue;
+        if (type == PRIM_QUAD && index < sections[SECTION_QUADS].count) continue;
+        if (type == PRIM_BOX && index < sections[SECTION_BOXES].count) continue;
+        return false;
+    }
+
+    // Walk the hierarchy in the depth-first order it is stored in, so every node is reached once
+    // and no path is deeper than the traversal stack
+    bvh_node *nodes = (bvh_node *)(base + sections[SECTION_NODES].offset);
+    uint64_t node_count = sections[SECTION_NODES].count;
+    if (node_count == 0) return true;
+    int stack[BVH_STACK_SIZE];
+    int depths[BVH_STACK_SIZE];
+    int top = 0;
+    int depth = 0;
+    uint64_t next = 0;
+    int64_t index = 0;
+    while (true) {
+        if (index < 0 || (uint64_t)index != next || next >= node_count) return false;
+        next++;
+        bvh_node *node = &nodes[index];
+        if (node->count > 0) {
+            if (node->offset < 0 || (uint64_t)node->offset + (uint64_t)node->count > prim_count) return false;
+            if (top == 0) break;
+            top--;
+            index = stack[top];
+            depth = depths[top];
+            continue;
+        }
+        if (node->count < 0 || depth >= BVH_STACK_SIZE - 1) return false;
+        stack[top] = node->offset;
+        depths[top++] = depth + 1;
+        index++;
+        depth++;
+    }
+    return next == node_count;
+}
+
+bool scene_cache_load(hittable_list *list, const char *path, bool verify) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(scene_cache_header)) {
+        close(fd);
+        return false;
+    }
+
+    // Read-only shared mapping, pages are shared by every process using the scene
+    size_t size = (size_t)st.st_size;
+    unsigned char *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return false;
+
+    // Validate the header before trusting any offset
+    scene_cache_header *header = (scene_cache_header *)base;
+    bool valid = header->magic == SCENE_CACHE_MAGIC && header->version == SCENE_CACHE_VERSION && header->endian == SCENE_CACHE_ENDIAN;
+    valid = valid && header->file_size == (uint64_t)size;
+    valid = valid && header->header_checksum == checksum(0, base, offsetof(scene_cache_header, header_checksum));
+    for (int k = 0; valid && k < SECTION_COUNT; k++) {
+        scene_section *section = &header->sections[k];
+        valid = header->element_sizes[k] == element_sizes[k] && section->offset % SCENE_CACHE_ALIGNMENT == 0;
+        valid = valid && section->count <= PRIM_MAX_COUNT * 2ULL && section->offset <= (uint64_t)size;
+        valid = valid && section->count <= ((uint64_t)size - section->offset) / element_sizes[k];
+    }
+
+    // Leaves index every bounded primitive exactly once
+    if (valid && header->sections[SECTION_NODES].count > 0) {
+        uint64_t bounded = header->sections[SECTION_SPHERES].count + header->sections[SECTION_QUADS].count + header->sections[SECTION_BOXES].count;
+        valid = header->sections[SECTION_PRIMS].count == bounded;
+    }
+
+    // Indices are cheap to check in one pass, unlike the checksum
+    valid = valid && valid_tables(base, header);
+
+    // The full data checksum touches every page, so it is only checked on request
+    if (valid && verify) {
+        size_t data_start = (size_t)aligned(sizeof(scene_cache_header));
+        valid = header->data_checksum == checksum_padded(0, base + data_start, size - data_start, size - data_start);
+    }
+    if (valid == false) {
+        munmap(base, size);
+        return false;
+    }
+
+    // Point the list straight into the mapping
+    hittable_list_create(list);
+    list->spheres = (sphere *)(base + header->sections[SECTION_SPHERES].offset);
+    list->sphere_count = (int)header->sections[SECTION_SPHERES].count;
+    list->quads = (quad *)(base + header->sections[SECTION_QUADS].offset);
+    list->quad_count = (int)header->sections[SECTION_QUADS].count;
+    list->boxes = (box *)(base + header->sections[SECTION_BOXES].offset);
+    list->box_count = (int)header->sections[SECTION_BOXES].count;
+    list->planes = (plane *)(base + header->sections[SECTION_PLANES].offset);
+    list->plane_count = (int)header->sections[SECTION_PLANES].count;
+    list->materials = (material *)(base + header->sections[SECTION_MATERIALS].offset);
+    list->material_count = (int)header->sections[SECTION_MATERIALS].count;
+    list->textures = (texture *)(base + header->sections[SECTION_TEXTURES].offset);
+    list->texture_count = (int)header->sections[SECTION_TEXTURES].count;
+    list->nodes = (bvh_node *)(base + header->sections[SECTION_NODES].offset);
+    list->node_count = (int)header->sections[SECTION_NODES].count;
+    list->prims = (uint32_t *)(base + header->sections[SECTION_PRIMS].offset);
+    list->mapping = base;
+    list->mapping_size = size;
+    return true;
+}
+
+void scene_cache_unload(hittable_list *list) {
+    if (list->mapping != NULL) munmap(list->mapping, list->mapping_size);
+    hittable_list_create(list);
+}
@@ -0,0 +1,46 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include "object.h"
+
+/* SCENE CACHE DEFINITION */
+
+#define SCENE_CACHE_MAGIC     0x43535452u // "RTSC"
+#define SCENE_CACHE_VERSION   2
+#define SCENE_CACHE_ENDIAN    0x01020304u
+#define SCENE_CACHE_ALIGNMENT 64
+
+typedef enum {
+    SECTION_SPHERES,
+    SECTION_QUADS,
+    SECTION_BOXES,
+    SECTION_PLANES,
+    SECTION_MATERIALS,
+    SECTION_TEXTURES,
+    SECTION_NODES,
+    SECTION_PRIMS,
+    SECTION_COUNT
+} scene_section_type;
+
+typedef struct {
+    uint64_t offset; // Byte offset from the start of the file
+    uint64_t count;
+} scene_section;
+
+// Every array is stored with offsets only so the file can be used in place at any address
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t endian;
+    uint32_t element_sizes[SECTION_COUNT]; // Record sizes, rejects files from a different layout
+    scene_section sections[SECTION_COUNT];
+    uint64_t file_size;
+    uint64_t data_checksum; // Everything after the header
+    uint64_t header_checksum; // Header bytes before this field
+} scene_cache_header;
+
+bool scene_cache_save(hittable_list *list, const char *path);
+bool scene_cache_load(hittable_list *list, const char *path, bool verify);
+void scene_cache_unload(hittable_list *list);
+
+#endif
@@ -0,0 +1,399 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <unistd.h>
+
+#include "framebuffer.h"
+#include "texture_cache.h"
+
+/* IMAGE LOADING */
+
+static bool read_header_int(FILE *file, int *out) {
+    // Header numbers may be separated by whitespace and comments
+    int c = fgetc(file);
+    while (c == '#' || c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+        if (c == '#') {
+            while (c != '\n' && c != EOF) c = fgetc(file);
+        }
+        c = fgetc(file);
+    }
+    if (c == EOF) return false;
+    ungetc(c, file);
+    return fscanf(file, "%d", out) == 1;
+}
+
+static float *load_ppm(FILE *file, bool binary, int *width, int *height) {
+    int maxval;
+    if (read_header_int(file, width) == false || read_header_int(file, height) == false || read_header_int(file, &maxval) == false) return NULL;
+    if (*width <= 0 || *height <= 0 || maxval <= 0 || maxval > 65535) return NULL;
+    fgetc(file); // Single whitespace before the raster
+
+    size_t count = (size_t)*width * (size_t)*height * 3;
+    float *texels = malloc(count * sizeof(float));
+    if (texels == NULL) {
+        fprintf(stderr, "Memory allocation failed for texture\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Undo the gamma 2 encoding written by write_color
+    for (size_t k = 0; k < count; k++) {
+        int value;
+        if (binary == false) {
+            if (fscanf(file, "%d", &value) != 1) value = -1;
+        } else if (maxval < 256) {
+            value = fgetc(file);
+        } else {
+            int high = fgetc(file);
+            int low = fgetc(file);
+            value = (high == EOF || low == EOF) ? -1 : ((high << 8) | low);
+        }
+        if (value < 0) {
+            free(texels);
+            return NULL;
+        }
+        float linear = (float)value / (float)maxval;
+        texels[k] = linear * linear;
+    }
+    return texels;
+}
+
+static float *load_image(const char *path, int *width, int *height) {
+    // PPM in plain or binary form, or color PFM, as linear RGB rows from the top
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    char magic[3] = {0};
+    float *texels = NULL;
+    if (fread(magic, 1, 2, file) == 2) {
+        if (strcmp(magic, "P3") == 0) texels = load_ppm(file, false, width, height);
+        else if (strcmp(magic, "P6") == 0) texels = load_ppm(file, true, width, height);
+        else if (strcmp(magic, "PF") == 0 && fseek(file, 0, SEEK_SET) == 0) texels = read_pfm(file, width, height);
+    }
+    fclose(file);
+    return texels;
+}
+
+/* MIPMAP DEFINITION */
+
+static bool write_tiles(texture_cache *cache, texture_level *level, float *texels) {
+    // Edge tiles repeat the last row and column
+    float tile[TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 3];
+    for (int ty = 0; ty < level->tiles_y; ty++) {
+        for (int tx = 0; tx < level->tiles_x; tx++) {
+            for (int y = 0; y < TEXTURE_TILE_SIZE; y++) {
+                int sy = (ty * TEXTURE_TILE_SIZE) + y;
+                if (sy >= level->height) sy = level->height - 1;
+                for (int x = 0; x < TEXTURE_TILE_SIZE; x++) {
+                    int sx = (tx * TEXTURE_TILE_SIZE) + x;
+                    if (sx >= level->width) sx = level->width - 1;
+                    memcpy(&tile[((y * TEXTURE_TILE_SIZE) + x) * 3], &texels[(((size_t)sy * level->width) + sx) * 3], 3 * sizeof(float));
+                }
+            }
+            if (fwrite(tile, TEXTURE_TILE_BYTES, 1, cache->backing) != 1) return false;
+        }
+    }
+    return true;
+}
+
+static float *downsample(float *texels, int width, int height, int *out_width, int *out_height) {
+    // Box filter over 2x2 texels, odd edges reuse the last texel
+    int w = (width > 1) ? width / 2 : 1;
+    int h = (height > 1) ? height / 2 : 1;
+    float *out = malloc((size_t)w * (size_t)h * 3 * sizeof(float));
+    if (out == NULL) {
+        fprintf(stderr, "Memory allocation failed for mipmap\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int y = 0; y < h; y++) {
+        int y0 = (2 * y < height) ? 2 * y : height - 1;
+        int y1 = (2 * y + 1 < height) ? 2 * y + 1 : height - 1;
+        for (int x = 0; x < w; x++) {
+            int x0 = (2 * x < width) ? 2 * x : width - 1;
+            int x1 = (2 * x + 1 < width) ? 2 * x + 1 : width - 1;
+            for (int c = 0; c < 3; c++) {
+                float sum = texels[(((size_t)y0 * width) + x0) * 3 + c] + texels[(((size_t)y0 * width) + x1) * 3 + c];
+                sum += texels[(((size_t)y1 * width) + x0) * 3 + c] + texels[(((size_t)y1 * width) + x1) * 3 + c];
+                out[(((size_t)y * w) + x) * 3 + c] = 0.25f * sum;
+            }
+        }
+    }
+    *out_width = w;
+    *out_height = h;
+    return out;
+}
+
+static bool build_image(texture_cache *cache, texture_image *image, const char *path, long *next_tile) {
+    // Only one level is held in memory at a time, every level goes to the backing file
+    int width, height;
+    float *texels = load_image(path, &width, &height);
+    if (texels == NULL) return false;
+
+    image->levels = 0;
+    while (image->levels < TEXTURE_MAX_LEVELS) {
+        texture_level *level = &image->level[image->levels++];
+        level->width = width;
+        level->height = height;
+        level->tiles_x = (width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+        level->tiles_y = (height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+        level->first_tile = *next_tile;
+        *next_tile += (long)level->tiles_x * level->tiles_y;
+        if (write_tiles(cache, level, texels) == false) {
+            free(texels);
+            return false;
+        }
+        if (width == 1 && height == 1) break;
+
+        float *next = downsample(texels, width, height, &width, &height);
+        free(texels);
+        texels = next;
+    }
+    free(texels);
+    return true;
+}
+
+/* TEXTURE CACHE DEFINITION */
+
+static void *cache_alloc(size_t size, const char *name) {
+    void *data = malloc(size);
+    if (data == NULL) {
+        fprintf(stderr, "Memory allocation failed for %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+bool texture_cache_create(texture_cache *cache, hittable_list *list, size_t budget) {
+    memset(cache, 0, sizeof(*cache));
+    cache->image_count = list->texture_count;
+    cache->images = calloc((size_t)(list->texture_count > 0 ? list->texture_count : 1), sizeof(texture_image));
+    if (cache->images == NULL) {
+        fprintf(stderr, "Memory allocation failed for texture images\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Convert every image to mipmapped tiles up front so rendering only ever reads tiles
+    long tile_count = 0;
+    for (int k = 0; k < list->texture_count; k++) {
+        if (list->textures[k].type != TEXTURE_IMAGE) continue;
+        if (cache->backing == NULL) cache->backing = tmpfile();
+        const char *path = list->textures[k].data.image.path;
+        if (cache->backing == NULL || build_image(cache, &cache->images[k], path, &tile_count) == false) {
+            fprintf(stderr, "Could not load texture %s\n", path);
+            texture_cache_free(cache);
+            return false;
+        }
+    }
+    if (cache->backing != NULL) fflush(cache->backing);
+
+    // Resident tiles are bounded by the budget, never more than the images hold
+    long slots = (long)(budget / TEXTURE_TILE_BYTES);
+    if (slots > tile_count) slots = tile_count;
+    if (slots < 1 && tile_count > 0) slots = 1;
+    cache->slot_count = (int)slots;
+    cache->shard_count = cache->slot_count / TEXTURE_SHARD_MIN;
+    if (cache->shard_count > TEXTURE_SHARDS) cache->shard_count = TEXTURE_SHARDS;
+    if (cache->shard_count < 1 && cache->slot_count > 0) cache->shard_count = 1;
+
+    cache->tiles = cache_alloc((size_t)cache->slot_count * TEXTURE_TILE_BYTES + 1, "texture tiles");
+    cache->keys = cache_alloc(((size_t)cache->slot_count + 1) * sizeof(long), "texture keys");
+    cache->bucket_next = cache_alloc(((size_t)cache->slot_count + 1) * sizeof(int), "texture buckets");
+    cache->lru_prev = cache_alloc(((size_t)cache->slot_count + 1) * sizeof(int), "texture lru");
+    cache->lru_next = cache_alloc(((size_t)cache->slot_count + 1) * sizeof(int), "texture lru");
+
+    // Slots are split evenly, each shard chains its empty slots from most to least recent
+    for (int s = 0; s < cache->shard_count; s++) {
+        texture_shard *shard = &cache->shards[s];
+        shard->first_slot = (int)(((long)cache->slot_count * s) / cache->shard_count);
+        shard->slot_count = (int)(((long)cache->slot_count * (s + 1)) / cache->shard_count) - shard->first_slot;
+        int buckets = 1;
+        while (buckets < 2 * shard->slot_count) buckets *= 2;
+        shard->bucket_mask = buckets - 1;
+        shard->bucket_heads = cache_alloc((size_t)buckets * sizeof(int), "texture buckets");
+        for (int k = 0; k < buckets; k++) shard->bucket_heads[k] = -1;
+
+        int last = shard->first_slot + shard->slot_count - 1;
+        for (int k = shard->first_slot; k <= last; k++) {
+            cache->keys[k] = -1;
+            cache->bucket_next[k] = -1;
+            cache->lru_prev[k] = (k > shard->first_slot) ? k - 1 : -1;
+            cache->lru_next[k] = (k < last) ? k + 1 : -1;
+        }
+        shard->lru_head = shard->first_slot;
+        shard->lru_tail = last;
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+
+    list->texture_cache = cache;
+    return true;
+}
+
+void texture_cache_free(texture_cache *cache) {
+    for (int s = 0; s < cache->shard_count; s++) {
+        pthread_mutex_destroy(&cache->shards[s].lock);
+        free(cache->shards[s].bucket_heads);
+    }
+    if (cache->backing != NULL) fclose(cache->backing);
+    free(cache->images);
+    free(cache->tiles);
+    free(cache->keys);
+    free(cache->bucket_next);
+    free(cache->lru_prev);
+    free(cache->lru_next);
+    memset(cache, 0, sizeof(*cache));
+}
+
+size_t texture_cache_size(texture_cache *cache) {
+    return (size_t)cache->slot_count * TEXTURE_TILE_BYTES;
+}
+
+void texture_cache_stats(texture_cache *cache, long long *hits, long long *misses) {
+    *hits = 0;
+    *misses = 0;
+    for (int s = 0; s < cache->shard_count; s++) {
+        pthread_mutex_lock(&cache->shards[s].lock);
+        *hits += cache->shards[s].hits;
+        *misses += cache->shards[s].misses;
+        pthread_mutex_unlock(&cache->shards[s].lock);
+    }
+}
+
+static uint64_t mix_key(long key) {
+    return (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+}
+
+static int bucket_of(texture_shard *shard, long key) {
+    return (int)((mix_key(key) >> 32) & (uint64_t)shard->bucket_mask);
+}
+
+static void touch(texture_cache *cache, texture_shard *shard, int slot) {
+    // Move the slot to the front of its shard's recency list
+    if (shard->lru_head == slot) return;
+    int prev = cache->lru_prev[slot];
+    int next = cache->lru_next[slot];
+    cache->lru_next[prev] = next;
+    if (next >= 0) cache->lru_prev[next] = prev;
+    else shard->lru_tail = prev;
+    cache->lru_prev[slot] = -1;
+    cache->lru_next[slot] = shard->lru_head;
+    cache->lru_prev[shard->lru_head] = slot;
+    shard->lru_head = slot;
+}
+
+static int find_slot(texture_cache *cache, texture_shard *shard, long key) {
+    // Caller holds the shard lock
+    for (int slot = shard->bucket_heads[bucket_of(shard, key)]; slot >= 0; slot = cache->bucket_next[slot]) {
+        if (cache->keys[slot] == key) return slot;
+    }
+    return -1;
+}
+
+static int insert_tile(texture_cache *cache, texture_shard *shard, long key, float *tile) {
+    // Caller holds the shard lock, evicts the least recently used tile of the shard
+    int slot = shard->lru_tail;
+    if (cache->keys[slot] >= 0) {
+        int *link = &shard->bucket_heads[bucket_of(shard, cache->keys[slot])];
+        while (*link != slot) link = &cache->bucket_next[*link];
+        *link = cache->bucket_next[slot];
+    }
+    memcpy(cache->tiles + ((size_t)slot * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 3), tile, TEXTURE_TILE_BYTES);
+    int bucket = bucket_of(shard, key);
+    cache->keys[slot] = key;
+    cache->bucket_next[slot] = shard->bucket_heads[bucket];
+    shard->bucket_heads[bucket] = slot;
+    return slot;
+}
+
+static float *lock_tile(texture_cache *cache, long key, texture_shard **locked) {
+    // Returns the resident tile with its shard still locked, the slot may be reused as soon as it is released
+    texture_shard *shard = &cache->shards[(mix_key(key) >> 59) % (uint64_t)cache->shard_count];
+    pthread_mutex_lock(&shard->lock);
+    int slot = find_slot(cache, shard, key);
+    if (slot < 0) {
+        // Miss: read the tile without holding the lock, another thread may load it meanwhile
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        float tile[TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 3];
+        if (pread(fileno(cache->backing), tile, TEXTURE_TILE_BYTES, (off_t)key * (off_t)TEXTURE_TILE_BYTES) != (ssize_t)TEXTURE_TILE_BYTES) {
+            memset(tile, 0, TEXTURE_TILE_BYTES);
+        }
+        pthread_mutex_lock(&shard->lock);
+        slot = find_slot(cache, shard, key);
+        if (slot < 0) slot = insert_tile(cache, shard, key, tile);
+    } else {
+        shard->hits++;
+    }
+    touch(cache, shard, slot);
+    *locked = shard;
+    return cache->tiles + ((size_t)slot * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 3);
+}
+
+static void texel_address(texture_level *level, int x, int y, long *key, int *offset) {
+    // Texture coordinates repeat outside the image
+    x %= level->width;
+    y %= level->height;
+    if (x < 0) x += level->width;
+    if (y < 0) y += level->height;
+    *key = level->first_tile + ((long)(y / TEXTURE_TILE_SIZE) * level->tiles_x) + (x / TEXTURE_TILE_SIZE);
+    *offset = (((y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE) + (x % TEXTURE_TILE_SIZE)) * 3;
+}
+
+static void bilinear(texture_cache *cache, texture_level *level, double u, double v, color *out) {
+    // Image rows run from the top, v runs from the bottom, both already wrapped to [0, 1]
+    double x = (u * level->width) - 0.5;
+    double y = ((1.0 - v) * level->height) - 0.5;
+    double x0 = floor(x), y0 = floor(y);
+    double fx = x - x0, fy = y - y0;
+    int ix = (int)x0, iy = (int)y0;
+
+    // Corners in the order 00, 10, 01, 11
+    long keys[4];
+    int offsets[4];
+    color c[4];
+    for (int k = 0; k < 4; k++) texel_address(level, ix + (k & 1), iy + (k >> 1), &keys[k], &offsets[k]);
+
+    // The footprint nearly always sits inside one tile, so each distinct tile is locked and touched once
+    for (int k = 0; k < 4; k++) {
+        if (keys[k] < 0) continue;
+        long key = keys[k];
+        texture_shard *shard;
+        float *tile = lock_tile(cache, key, &shard);
+        for (int n = k; n < 4; n++) {
+            if (keys[n] != key) continue;
+            float *t = tile + offsets[n];
+            create(&c[n], t[0], t[1], t[2]);
+            keys[n] = -1;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    for (int k = 0; k < 3; k++) {
+        double top = c[0][k] + (fx * (c[1][k] - c[0][k]));
+        double bottom = c[2][k] + (fx * (c[3][k] - c[2][k]));
+        (*out)[k] = top + (fy * (bottom - top));
+    }
+}
+
+void texture_cache_sample(texture_cache *cache, int index, double u, double v, double footprint, color *out) {
+    texture_image *image = &cache->images[index];
+    if (image->levels == 0 || cache->slot_count == 0) {
+        create(out, 1.0, 1.0, 1.0);
+        return;
+    }
+
+    // Mip level where one texel covers the footprint, blended with the next coarser level
+    texture_level *base = &image->level[0];
+    int extent = (base->width > base->height) ? base->width : base->height;
+    double lod = log2(fmax(footprint * extent, 1e-9));
+    lod = fmin(fmax(lod, 0.0), (double)(image->levels - 1));
+    int fine = (int)lod;
+    double blend = lod - fine;
+
+    // Wrap first, so huge or non-finite coordinates never reach an int conversion
+    u = isfinite(u) ? u - floor(u) : 0.0;
+    v = isfinite(v) ? v - floor(v) : 0.0;
+
+    bilinear(cache, &image->level[fine], u, v, out);
+    if (blend > 0.0 && fine + 1 < image->levels) {
+        color coarse;
+        bilinear(cache, &image->level[fine + 1], u, v, &coarse);
+        for (int c = 0; c < 3; c++) (*out)[c] += blend * (coarse[c] - (*out)[c]);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <pthread.h>
+
+#include "object.h"
+
+/* TEXTURE CACHE DEFINITION */
+
+#define TEXTURE_TILE_SIZE  32 // Texels along each side of a tile
+#define TEXTURE_TILE_BYTES (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 3 * sizeof(float))
+#define TEXTURE_MAX_LEVELS 24
+#define TEXTURE_SHARDS     16 // Independently locked parts of the resident set
+#define TEXTURE_SHARD_MIN  32 // Fewest slots per shard, smaller shards evict hot tiles early
+
+typedef struct {
+    int width;
+    int height;
+    int tiles_x;
+    int tiles_y;
+    long first_tile; // Tile number of the level's first tile in the backing file
+} texture_level;
+
+typedef struct {
+    int levels; // Zero for procedural textures
+    texture_level level[TEXTURE_MAX_LEVELS];
+} texture_image;
+
+// Resident tiles are split into shards by tile number, each with its own lock and recency order
+typedef struct {
+    pthread_mutex_t lock;
+    int first_slot; // Slots first_slot to first_slot + slot_count - 1 belong to this shard
+    int slot_count;
+    int *bucket_heads; // Hash buckets over the keys, chained through bucket_next
+    int bucket_mask;
+
+    // Least recently used order, head is the most recent
+    int lru_head;
+    int lru_tail;
+
+    // Statistics
+    long long hits;
+    long long misses;
+} texture_shard;
+
+// Images live as mipmapped tiles in a backing file, only a bounded set of tiles is resident
+typedef struct texture_cache {
+    FILE *backing; // Read with pread, so lookups never share a file position
+    texture_image *images; // Indexed like the texture table
+    int image_count;
+
+    // Resident tiles, a slot holds one tile and its key is the tile number
+    int slot_count;
+    float *tiles;
+    long *keys; // -1 for an empty slot
+    int *bucket_next;
+    int *lru_prev;
+    int *lru_next;
+    texture_shard shards[TEXTURE_SHARDS];
+    int shard_count; // Fewer than TEXTURE_SHARDS for small budgets
+} texture_cache;
+
+bool texture_cache_create(texture_cache *cache, hittable_list *list, size_t budget);
+void texture_cache_free(texture_cache *cache);
+size_t texture_cache_size(texture_cache *cache);
+void texture_cache_stats(texture_cache *cache, long long *hits, long long *misses);
+void texture_cache_sample(texture_cache *cache, int index, double u, double v, double footprint, color *out);
+
+#endif
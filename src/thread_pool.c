@@ -0,0 +1,97 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+/* THREAD POOL DEFINITION */
+
+int cpu_count(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count < 1) ? 1 : (int)count;
+}
+
+static void run_jobs(thread_pool *pool) {
+    // Called with the lock held, released while a job runs
+    while (pool->next < pool->jobs) {
+        int index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->job(pool->context, index);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->jobs) pthread_cond_broadcast(&pool->done);
+    }
+}
+
+static void *worker(void *arg) {
+    thread_pool *pool = arg;
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->stop == false && pool->generation == seen) pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop) break;
+        seen = pool->generation;
+        run_jobs(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void thread_pool_create(thread_pool *pool, int threads) {
+    pool->worker_count = (threads > 1) ? threads - 1 : 0;
+    pool->threads = NULL;
+    pool->jobs = 0;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->generation = 0;
+    pool->stop = false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    if (pool->worker_count == 0) return;
+
+    pool->threads = malloc(sizeof(pthread_t) * (size_t)pool->worker_count);
+    if (pool->threads == NULL) {
+        fprintf(stderr, "Memory allocation failed for thread pool\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < pool->worker_count; k++) {
+        if (pthread_create(&pool->threads[k], NULL, worker, pool) != 0) {
+            fprintf(stderr, "Could not start worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void thread_pool_free(thread_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int k = 0; k < pool->worker_count; k++) pthread_join(pool->threads[k], NULL);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+}
+
+void thread_pool_run(thread_pool *pool, int jobs, thread_job job, void *context) {
+    // Without workers the jobs simply run in order
+    if (pool->worker_count == 0) {
+        for (int k = 0; k < jobs; k++) job(context, k);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->context = context;
+    pool->jobs = jobs;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    run_jobs(pool);
+    while (pool->finished < pool->jobs) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
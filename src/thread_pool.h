@@ -0,0 +1,34 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* THREAD POOL DEFINITION */
+
+typedef void (*thread_job)(void *context, int index);
+
+// Workers that sleep between runs, the calling thread always takes jobs too
+typedef struct {
+    pthread_t *threads;
+    int worker_count;
+
+    // Current run, guarded by the lock
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    thread_job job;
+    void *context;
+    int jobs;
+    int next;
+    int finished;
+    unsigned generation;
+    bool stop;
+} thread_pool;
+
+int cpu_count(void);
+void thread_pool_create(thread_pool *pool, int threads);
+void thread_pool_free(thread_pool *pool);
+void thread_pool_run(thread_pool *pool, int jobs, thread_job job, void *context);
+
+#endif
@@ -1,6 +1,35 @@
 #include "vector.h"
 #include "object.h"
 
+/* RANDOM DEFINITION */
+
+static uint64_t rng_state = 0x853C49E6748FEA9BULL;
+
+void random_seed(uint64_t seed) {
+    // Scramble the seed with splitmix64 so nearby seeds give unrelated streams
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    rng_state = (z != 0) ? z : 0x853C49E6748FEA9BULL; // xorshift state can never be zero
+}
+
+uint64_t random_get_state(void) {
+    return rng_state;
+}
+
+void random_set_state(uint64_t state) {
+    rng_state = state;
+}
+
+double random_double(void) {
+    // xorshift64* generator, top 53 bits mapped to [0, 1)
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (double)((rng_state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
 /* VEC3 DEFINITION */
 
 void create(vec3 *a, double x, double y, double z) {
@@ -159,6 +188,8 @@ void ray_create(ray *r, point3 *origin, vec3 *direction) {
     r->direction[0] = (*direction)[0];
     r->direction[1] = (*direction)[1];
     r->direction[2] = (*direction)[2];
+    r->width = 0.0;
+    r->spread = 0.0;
 }
 
 void ray_at(ray *r, double t, point3 *out) {
@@ -174,11 +205,14 @@ double linear_to_gamma(double linear_component) {
     return 0.0; // Return 0 for negative or zero values
 }
 
-void write_color(FILE *image, color *color) {
+void color_bytes(color *color, unsigned char *out) {
     // Clamp color values to the range [0, 1] and convert to 8-bit integers
     interval intensity = {0.000, 0.999};
-    int rbyte = (int)(256 * clamp(&intensity, linear_to_gamma((*color)[0])));
-    int gbyte = (int)(256 * clamp(&intensity, linear_to_gamma((*color)[1])));
-    int bbyte = (int)(256 * clamp(&intensity, linear_to_gamma((*color)[2])));
-    fprintf(image, "%d %d %d\n", rbyte, gbyte, bbyte);
+    for (int axis = 0; axis < 3; axis++) out[axis] = (unsigned char)(256 * clamp(&intensity, linear_to_gamma((*color)[axis])));
+}
+
+void write_color(FILE *image, color *color) {
+    unsigned char bytes[3];
+    color_bytes(color, bytes);
+    fprintf(image, "%d %d %d\n", bytes[0], bytes[1], bytes[2]);
 }
@@ -2,11 +2,19 @@
 #define VECTOR_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <math.h>
 
 #include "main.h"
 
+/* RANDOM DEFINITION */
+
+void random_seed(uint64_t seed);
+uint64_t random_get_state(void);
+void random_set_state(uint64_t state);
+double random_double(void);
+
 /* VEC3 DEFINITION */
 
 typedef double vec3[3];
@@ -37,6 +45,10 @@ typedef vec3 point3;
 typedef struct {
     point3 origin;
     vec3 direction;
+
+    // Ray cone used to filter textures, zero for an infinitely thin ray
+    double width; // Cone width at the origin
+    double spread; // Cone angle in radians
 } ray;
 
 void ray_create(ray *r, point3 *origin, vec3 *direction);
@@ -47,6 +59,7 @@ void ray_at(ray *r, double t, point3 *out);
 typedef vec3 color;
 
 double linear_to_gamma(double linear_component);
+void color_bytes(color *color, unsigned char *out);
 void write_color(FILE *image, color *color);
 
 #endif